@@ -20,94 +20,73 @@
 #include "Arduino.h"
 #include "AsyncEventSource.h"
 
-static String generateEventMessage(const char *message, const char *event, uint32_t id, uint32_t reconnect){
-  String ev;
-
-  if(reconnect){
-    ev += F("retry: ");
-    ev += reconnect;
-    ev += F("\r\n");
-  }
-
-  if(id){
-    ev += F("id: ");
-    ev += String(id);
-    ev += F("\r\n");
-  }
+//decimal digits of v into buf, returns their count
+static size_t eventNumber(char *buf, uint32_t v){
+  char digits[10];
+  size_t n = 0;
+  do {
+    digits[n++] = '0' + (v % 10);
+    v /= 10;
+  } while(v);
+  for(size_t i = 0; i < n; i++)
+    buf[i] = digits[n - 1 - i];
+  return n;
+}
 
+//writes the event to out and returns its length. With out NULL only the length is counted,
+//so the caller can allocate exactly once and call again
+static size_t generateEventMessage(uint8_t *out, const uint8_t *message, size_t len, const char *event, uint32_t id, uint32_t reconnect){
+  size_t pos = 0;
+  auto put = [&](const void *data, size_t n){
+    if(out != NULL)
+      memcpy(out + pos, data, n);
+    pos += n;
+  };
+  auto putField = [&](const char *name, size_t nameLen, uint32_t value){
+    char number[10];
+    put(name, nameLen);
+    put(number, eventNumber(number, value));
+    put("\r\n", 2);
+  };
+
+  if(reconnect)
+    putField("retry: ", 7, reconnect);
+  if(id)
+    putField("id: ", 4, id);
   if(event != NULL){
-    ev += F("event: ");
-    ev += String(event);
-    ev += F("\r\n");
+    put("event: ", 7);
+    put(event, strlen(event));
+    put("\r\n", 2);
   }
 
   if(message != NULL){
-    size_t messageLen = strlen(message);
-    char * lineStart = (char *)message;
-    char * lineEnd;
+    //one data line per line of the message, CRLF and LFCR count as one break
+    const uint8_t *line = message;
+    const uint8_t *end = message + len;
     do {
-      char * nextN = strchr(lineStart, '\n');
-      char * nextR = strchr(lineStart, '\r');
-      if(nextN == NULL && nextR == NULL){
-        size_t llen = ((char *)message + messageLen) - lineStart;
-        char * ldata = (char *)malloc(llen+1);
-        if(ldata != NULL){
-          memcpy(ldata, lineStart, llen);
-          ldata[llen] = 0;
-          ev += F("data: ");
-          ev += ldata;
-          ev += F("\r\n\r\n");
-          free(ldata);
-        }
-        lineStart = (char *)message + messageLen;
-      } else {
-        char * nextLine = NULL;
-        if(nextN != NULL && nextR != NULL){
-          if(nextR < nextN){
-            lineEnd = nextR;
-            if(nextN == (nextR + 1))
-              nextLine = nextN + 1;
-            else
-              nextLine = nextR + 1;
-          } else {
-            lineEnd = nextN;
-            if(nextR == (nextN + 1))
-              nextLine = nextR + 1;
-            else
-              nextLine = nextN + 1;
-          }
-        } else if(nextN != NULL){
-          lineEnd = nextN;
-          nextLine = nextN + 1;
-        } else {
-          lineEnd = nextR;
-          nextLine = nextR + 1;
-        }
-
-        size_t llen = lineEnd - lineStart;
-        char * ldata = (char *)malloc(llen+1);
-        if(ldata != NULL){
-          memcpy(ldata, lineStart, llen);
-          ldata[llen] = 0;
-          ev += F("data: ");
-          ev += ldata;
-          ev += F("\r\n");
-          free(ldata);
-        }
-        lineStart = nextLine;
-        if(lineStart == ((char *)message + messageLen))
-          ev += F("\r\n");
+      const uint8_t *lineEnd = line;
+      while(lineEnd < end && *lineEnd != '\n' && *lineEnd != '\r')
+        lineEnd++;
+      put("data: ", 6);
+      put(line, lineEnd - line);
+      put("\r\n", 2);
+      line = lineEnd;
+      if(line < end){
+        const uint8_t brk = *line++;
+        if(line < end && (*line == '\n' || *line == '\r') && *line != brk)
+          line++;
       }
-    } while(lineStart < ((char *)message + messageLen));
+    } while(line < end);
+    put("\r\n", 2);
   }
 
-  return ev;
+  return pos;
 }
 
 // Message
 
-AsyncEventSourceMessage::AsyncEventSourceMessage(const char * data, size_t len)
-: _data(nullptr), _len(len), _sent(0), _acked(0)
+AsyncEventSourceMessage::AsyncEventSourceMessage(const char * data, size_t len, ArMessageEventHandler onEvent)
+: _data(nullptr), _len(len), _sent(0), _acked(0), _eventHandler(onEvent), _events(0)
 {
   _data = (uint8_t*)malloc(_len+1);
   if(_data == nullptr){
@@ -118,11 +97,38 @@ AsyncEventSourceMessage::AsyncEventSourceMessage(const char * data, size_t len)
   }
 }
 
+AsyncEventSourceMessage::AsyncEventSourceMessage(size_t len, ArMessageEventHandler onEvent)
+: _data(nullptr), _len(len), _sent(0), _acked(0), _eventHandler(onEvent), _events(0)
+{
+  _data = (uint8_t*)malloc(_len+1);
+  if(_data == nullptr){
+    _len = 0;
+  } else {
+    _data[_len] = 0;
+  }
+}
+
 AsyncEventSourceMessage::~AsyncEventSourceMessage() {
      if(_data != NULL)
         free(_data);
 }
 
+void AsyncEventSourceMessage::_notify(ArMessageEventType type){
+  if(!_eventHandler || (_events & (1 << type)))
+    return;
+  _events |= (1 << type);
+  _eventHandler(type);
+}
+
+void AsyncEventSourceMessage::_released(){
+  if(_data != NULL && finished()){
+    _notify(SSE_MSG_EVT_SENT);
+    _notify(SSE_MSG_EVT_ACKED);
+  } else {
+    _notify(SSE_MSG_EVT_DROPPED);
+  }
+}
+
 size_t AsyncEventSourceMessage::ack(size_t len, uint32_t time) {
   (void)time;
   // If the whole message is now acked...
@@ -152,11 +158,12 @@ size_t AsyncEventSourceMessage::send(AsyncClient *client) {
 // Client
 
 AsyncEventSourceClient::AsyncEventSourceClient(AsyncWebServerRequest *request, AsyncEventSource *server)
-: _messageQueue(LinkedList<AsyncEventSourceMessage *>([](AsyncEventSourceMessage *m){ delete  m; }))
+: _messageQueue(LinkedList<AsyncEventSourceMessage *>([](AsyncEventSourceMessage *m){ m->_released(); delete  m; }))
 {
   _client = request->client();
   _server = server;
   _lastId = 0;
+  _drainPending = false;
   if(request->hasHeader(F("Last-Event-ID")))
     _lastId = atoi(request->getHeader(F("Last-Event-ID"))->value().c_str());
 
@@ -169,7 +176,7 @@ AsyncEventSourceClient::AsyncEventSourceClient(AsyncWebServerRequest *request, A
   _client->onDisconnect([this](void *r, AsyncClient* c){ ((AsyncEventSourceClient*)(r))->_onDisconnect(); delete c; }, this);
 
   _server->_addClient(this);
-  delete request;
+  request->_server->_releaseRequest(request);
 }
 
 AsyncEventSourceClient::~AsyncEventSourceClient(){
@@ -181,14 +188,17 @@ void AsyncEventSourceClient::_queueMessage(AsyncEventSourceMessage *dataMessage)
   if(dataMessage == NULL)
     return;
   if(!connected()){
+    dataMessage->_released();
     delete dataMessage;
     return;
   }
   if(_messageQueue.length() >= SSE_MAX_QUEUED_MESSAGES){
       ets_printf(String(F("ERROR: Too many messages queued\n")).c_str());
+      dataMessage->_released();
       delete dataMessage;
   } else {
       _messageQueue.add(dataMessage);
+      _drainPending = true;
   }
   if(_client->canSend())
     _runQueue();
@@ -202,6 +212,11 @@ void AsyncEventSourceClient::_onAck(size_t len, uint32_t time){
   }
 
   _runQueue();
+
+  if(_drainPending && _messageQueue.isEmpty()){
+    _drainPending = false;
+    _server->_handleDrain(this);
+  }
 }
 
 void AsyncEventSourceClient::_onPoll(){
@@ -225,13 +240,23 @@ void AsyncEventSourceClient::close(){
     _client->close();
 }
 
-void AsyncEventSourceClient::write(const char * message, size_t len){
-  _queueMessage(new AsyncEventSourceMessage(message, len));
+void AsyncEventSourceClient::write(const char * message, size_t len, ArMessageEventHandler onEvent){
+  _queueMessage(new AsyncEventSourceMessage(message, len, onEvent));
 }
 
 void AsyncEventSourceClient::send(const char *message, const char *event, uint32_t id, uint32_t reconnect){
-  String ev = generateEventMessage(message, event, id, reconnect);
-  _queueMessage(new AsyncEventSourceMessage(ev.c_str(), ev.length()));
+  send(message, event, id, reconnect, NULL);
+}
+
+void AsyncEventSourceClient::send(const char *message, const char *event, uint32_t id, uint32_t reconnect, ArMessageEventHandler onEvent){
+  send((const uint8_t *)message, (message != NULL) ? strlen(message) : 0, event, id, reconnect, onEvent);
+}
+
+void AsyncEventSourceClient::send(const uint8_t *message, size_t len, const char *event, uint32_t id, uint32_t reconnect, ArMessageEventHandler onEvent){
+  AsyncEventSourceMessage *dataMessage = new AsyncEventSourceMessage(generateEventMessage(NULL, message, len, event, id, reconnect), onEvent);
+  if(dataMessage != NULL && dataMessage->data() != NULL)
+    generateEventMessage(dataMessage->data(), message, len, event, id, reconnect);
+  _queueMessage(dataMessage);
 }
 
 void AsyncEventSourceClient::_runQueue(){
@@ -241,8 +266,11 @@ void AsyncEventSourceClient::_runQueue(){
 
   for(auto i = _messageQueue.begin(); i != _messageQueue.end(); ++i)
   {
-    if(!(*i)->sent())
+    if(!(*i)->sent()){
       (*i)->send(_client);
+      if((*i)->sent())
+        (*i)->_notify(SSE_MSG_EVT_SENT);
+    }
   }
 }
 
@@ -263,6 +291,10 @@ void AsyncEventSource::onConnect(ArEventHandlerFunction cb){
   _connectcb = cb;
 }
 
+void AsyncEventSource::onDrain(ArEventHandlerFunction cb){
+  _draincb = cb;
+}
+
 void AsyncEventSource::authorizeConnect(ArAuthorizeConnectHandler cb){
   _authorizeConnectHandler = cb;
 }
@@ -316,14 +348,36 @@ size_t AsyncEventSource::avgPacketsWaiting() const {
 }
 
 void AsyncEventSource::send(const char *message, const char *event, uint32_t id, uint32_t reconnect){
+  send((const uint8_t *)message, (message != NULL) ? strlen(message) : 0, event, id, reconnect);
+}
 
-
-  String ev = generateEventMessage(message, event, id, reconnect);
+void AsyncEventSource::send(const uint8_t *message, size_t len, const char *event, uint32_t id, uint32_t reconnect){
+  //encoded once, into the message of the first connected client. Every other client's message is sized
+  //the same and copied from it. The first one is queued last, as a full queue would free it right away
+  AsyncEventSourceMessage *first = NULL;
+  AsyncEventSourceClient *firstClient = NULL;
+  size_t evLen = 0;
   for(const auto &c: _clients){
-    if(c->connected()) {
-      c->write(ev.c_str(), ev.length());
+    if(!c->connected())
+      continue;
+    if(first == NULL){
+      evLen = generateEventMessage(NULL, message, len, event, id, reconnect);
+      first = new AsyncEventSourceMessage(evLen);
+      if(first == NULL || first->data() == NULL){
+        delete first;
+        return;
+      }
+      generateEventMessage(first->data(), message, len, event, id, reconnect);
+      firstClient = c;
+      continue;
     }
+    AsyncEventSourceMessage *dataMessage = new AsyncEventSourceMessage(evLen);
+    if(dataMessage != NULL && dataMessage->data() != NULL)
+      memcpy(dataMessage->data(), first->data(), evLen);
+    c->_queueMessage(dataMessage);
   }
+  if(first != NULL)
+    firstClient->_queueMessage(first);
 }
 
 size_t AsyncEventSource::count() const {
@@ -50,21 +50,32 @@ class AsyncEventSourceResponse;
 class AsyncEventSourceClient;
 typedef std::function<void(AsyncEventSourceClient *client)> ArEventHandlerFunction;
 typedef std::function<bool(AsyncWebServerRequest *request)> ArAuthorizeConnectHandler;
+//what became of an event: every byte handed to TCP, acked by the peer, or never delivered
+typedef enum { SSE_MSG_EVT_SENT, SSE_MSG_EVT_ACKED, SSE_MSG_EVT_DROPPED } ArMessageEventType;
+typedef std::function<void(ArMessageEventType type)> ArMessageEventHandler;
 
-class AsyncEventSourceMessage {
+class AsyncEventSourceMessage: public AsyncWebPooled<AsyncEventSourceMessage> {
   private:
     uint8_t * _data; 
     size_t _len;
     size_t _sent;
     //size_t _ack;
     size_t _acked; 
+    ArMessageEventHandler _eventHandler;
+    uint8_t _events; //bit per ArMessageEventType already reported
   public:
-    AsyncEventSourceMessage(const char * data, size_t len);
+    AsyncEventSourceMessage(const char * data, size_t len, ArMessageEventHandler onEvent = NULL);
+    //len bytes to be written through data()
+    AsyncEventSourceMessage(size_t len, ArMessageEventHandler onEvent = NULL);
     ~AsyncEventSourceMessage();
     size_t ack(size_t len, uint32_t time __attribute__((unused)));
     size_t send(AsyncClient *client);
     bool finished(){ return _acked == _len; }
     bool sent() { return _sent == _len; }
+    uint8_t * data() { return _data; }
+    void _notify(ArMessageEventType type);
+    //the client is done with the message, right before it is deleted
+    void _released();
 };
 
 class AsyncEventSourceClient {
@@ -72,6 +83,7 @@ class AsyncEventSourceClient {
     AsyncClient *_client;
     AsyncEventSource *_server;
     uint32_t _lastId;
+    bool _drainPending; //events were queued since the last drain
     LinkedList<AsyncEventSourceMessage *> _messageQueue;
     void _queueMessage(AsyncEventSourceMessage *dataMessage);
     void _runQueue();
@@ -83,8 +95,12 @@ class AsyncEventSourceClient {
 
     AsyncClient* client(){ return _client; }
     void close();
-    void write(const char * message, size_t len);
+    void write(const char * message, size_t len, ArMessageEventHandler onEvent = NULL);
     void send(const char *message, const char *event=NULL, uint32_t id=0, uint32_t reconnect=0);
+    //onEvent gets SSE_MSG_EVT_SENT and then SSE_MSG_EVT_ACKED, or SSE_MSG_EVT_DROPPED
+    void send(const char *message, const char *event, uint32_t id, uint32_t reconnect, ArMessageEventHandler onEvent);
+    //the message by length, it may hold any bytes but line breaks, which split it into data lines
+    void send(const uint8_t *message, size_t len, const char *event=NULL, uint32_t id=0, uint32_t reconnect=0, ArMessageEventHandler onEvent=NULL);
     bool connected() const { return (_client != NULL) && _client->connected(); }
     uint32_t lastId() const { return _lastId; }
     size_t  packetsWaiting() const { return _messageQueue.length(); }
@@ -94,6 +110,8 @@ class AsyncEventSourceClient {
     void _onPoll(); 
     void _onTimeout(uint32_t time);
     void _onDisconnect();
+
+    friend class AsyncEventSource;
 };
 
 class AsyncEventSource: public AsyncWebHandler {
@@ -101,6 +119,7 @@ class AsyncEventSource: public AsyncWebHandler {
     String _url;
     LinkedList<AsyncEventSourceClient *> _clients;
     ArEventHandlerFunction _connectcb;
+    ArEventHandlerFunction _draincb;
 	ArAuthorizeConnectHandler _authorizeConnectHandler;
   public:
     AsyncEventSource(const String& url);
@@ -109,14 +128,18 @@ class AsyncEventSource: public AsyncWebHandler {
     const char * url() const { return _url.c_str(); }
     void close();
     void onConnect(ArEventHandlerFunction cb);
+    //a client has every event queued for it acked
+    void onDrain(ArEventHandlerFunction cb);
     void authorizeConnect(ArAuthorizeConnectHandler cb);
     void send(const char *message, const char *event=NULL, uint32_t id=0, uint32_t reconnect=0);
+    void send(const uint8_t *message, size_t len, const char *event=NULL, uint32_t id=0, uint32_t reconnect=0);
     size_t count() const; //number clinets connected
     size_t  avgPacketsWaiting() const;
 
     //system callbacks (do not call)
     void _addClient(AsyncEventSourceClient * client);
     void _handleDisconnect(AsyncEventSourceClient * client);
+    void _handleDrain(AsyncEventSourceClient * client){ if(_draincb) _draincb(client); }
     virtual bool canHandle(AsyncWebServerRequest *request) override final;
     virtual void handleRequest(AsyncWebServerRequest *request) override final;
 };
@@ -0,0 +1,145 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBARENA_H_
+#define ASYNCWEBARENA_H_
+
+#include "stddef.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <new>
+#include <utility>
+#include "StringArray.h"
+
+//size of the first arena block of a request. 0 disables the arena (plain malloc/free)
+#ifndef ASYNCWEBSERVER_ARENA_FIRST_BLOCK
+#define ASYNCWEBSERVER_ARENA_FIRST_BLOCK 512
+#endif
+
+//minimum size of every further block
+#ifndef ASYNCWEBSERVER_ARENA_CHUNK
+#define ASYNCWEBSERVER_ARENA_CHUNK 256
+#endif
+
+/*
+ * ARENA :: Bump allocator for objects that live as long as a request.
+ * Nothing is given back individually, all blocks are freed at once in release()
+ * */
+
+class AsyncWebArena: public LinkedListAllocator {
+  private:
+    struct Block {
+      Block* next;
+      size_t size;
+      size_t used;
+    };
+    static const size_t ALIGN = 8;
+    static size_t _align(size_t size){ return (size + ALIGN - 1) & ~(ALIGN - 1); }
+    static uint8_t* _data(Block* b){ return (uint8_t*)b + _align(sizeof(Block)); }
+
+    Block* _blocks; //the block being filled is first
+    size_t _firstBlockSize;
+    size_t _chunkSize;
+
+    Block* _newBlock(size_t size){
+      Block* b = (Block*)malloc(_align(sizeof(Block)) + size);
+      if(b == NULL)
+        return NULL;
+      b->size = size;
+      b->used = 0;
+      b->next = _blocks;
+      _blocks = b;
+      return b;
+    }
+
+  public:
+    AsyncWebArena(size_t firstBlockSize = ASYNCWEBSERVER_ARENA_FIRST_BLOCK, size_t chunkSize = ASYNCWEBSERVER_ARENA_CHUNK)
+      : _blocks(NULL), _firstBlockSize(firstBlockSize), _chunkSize(chunkSize) {}
+    ~AsyncWebArena(){ release(); }
+    AsyncWebArena(const AsyncWebArena &) = delete;
+    AsyncWebArena &operator=(const AsyncWebArena &) = delete;
+
+    void* allocate(size_t size) override {
+      if(!_firstBlockSize)
+        return malloc(size);
+      size = _align(size);
+      Block* b = _blocks;
+      if(b == NULL || b->size - b->used < size){
+        size_t blockSize = (b == NULL) ? _firstBlockSize : _chunkSize;
+        if(blockSize < size)
+          blockSize = size;
+        b = _newBlock(blockSize);
+        if(b == NULL)
+          return NULL;
+      }
+      void* ptr = _data(b) + b->used;
+      b->used += size;
+      return ptr;
+    }
+
+    void deallocate(void* ptr, size_t size __attribute__((unused))) override {
+      if(!_firstBlockSize)
+        free(ptr);
+    }
+
+    void release(){
+      while(_blocks != NULL){
+        Block* b = _blocks;
+        _blocks = b->next;
+        free(b);
+      }
+    }
+
+    //like release(), but keeps the first block for the next user
+    void reset(){
+      while(_blocks != NULL && _blocks->next != NULL){
+        Block* b = _blocks;
+        _blocks = b->next;
+        free(b);
+      }
+      if(_blocks != NULL)
+        _blocks->used = 0;
+    }
+
+    //allocator for lists whose nodes should come from the arena, NULL when it is disabled
+    LinkedListAllocator* listAllocator(){ return _firstBlockSize ? this : nullptr; }
+
+    template<typename T, typename... Args>
+    T* make(Args&&... args){
+      if(!_firstBlockSize)
+        return new T(std::forward<Args>(args)...);
+      void* mem = allocate(sizeof(T));
+      return mem ? new(mem) T(std::forward<Args>(args)...) : nullptr;
+    }
+
+    template<typename T>
+    void destroy(T* t){
+      if(t == nullptr)
+        return;
+      if(!_firstBlockSize){
+        delete t;
+        return;
+      }
+      t->~T();
+      deallocate(t, sizeof(T));
+    }
+};
+
+#endif /* ASYNCWEBARENA_H_ */
@@ -0,0 +1,181 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBSLAB_H_
+#define ASYNCWEBSLAB_H_
+
+#include "stddef.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include "AsyncWebSynchronization.h"
+
+//serve list nodes, headers, params and websocket/event source messages from fixed-size slabs
+#ifndef ASYNCWEBSERVER_SLAB_ALLOCATOR
+#define ASYNCWEBSERVER_SLAB_ALLOCATOR 0
+#endif
+
+//objects carved out of every slab
+#ifndef ASYNCWEBSERVER_SLAB_OBJECTS
+#define ASYNCWEBSERVER_SLAB_OBJECTS 16
+#endif
+
+typedef struct {
+    size_t inUse;     //objects handed out right now
+    size_t highWater; //most objects ever handed out at once
+    size_t failures;  //allocations that could not get memory
+    size_t slabs;     //slabs taken from the heap
+} AsyncWebSlabStats;
+
+/*
+ * SLAB POOL :: Free list of equally sized objects, grown one slab at a time.
+ * Slabs go back to the heap only in trim(), so the heap never sees the small blocks
+ * */
+
+class AsyncWebSlabPool {
+  private:
+    struct FreeItem {
+      FreeItem* next;
+    };
+    struct Slab {
+      Slab* next;
+    };
+    static const size_t ALIGN = 8;
+    static size_t _align(size_t size){ return (size + ALIGN - 1) & ~(ALIGN - 1); }
+
+    size_t _itemSize;
+    size_t _perSlab;
+    Slab* _slabs;
+    FreeItem* _free;
+    AsyncWebSlabStats _stats;
+    AsyncWebLock _lock;
+
+    bool _grow(){
+      size_t head = _align(sizeof(Slab));
+      Slab* s = (Slab*)malloc(head + _itemSize * _perSlab);
+      if(s == NULL)
+        return false;
+      s->next = _slabs;
+      _slabs = s;
+      uint8_t* items = (uint8_t*)s + head;
+      for(size_t i = 0; i < _perSlab; i++){
+        FreeItem* f = (FreeItem*)(items + i * _itemSize);
+        f->next = _free;
+        _free = f;
+      }
+      _stats.slabs++;
+      return true;
+    }
+
+  public:
+    AsyncWebSlabPool(size_t itemSize, size_t perSlab = ASYNCWEBSERVER_SLAB_OBJECTS)
+      : _itemSize(_align(itemSize < sizeof(FreeItem) ? sizeof(FreeItem) : itemSize))
+      , _perSlab(perSlab ? perSlab : 1)
+      , _slabs(NULL)
+      , _free(NULL)
+      , _stats{0, 0, 0, 0} {}
+    ~AsyncWebSlabPool(){
+      while(_slabs != NULL){
+        Slab* s = _slabs;
+        _slabs = s->next;
+        free(s);
+      }
+    }
+    AsyncWebSlabPool(const AsyncWebSlabPool &) = delete;
+    AsyncWebSlabPool &operator=(const AsyncWebSlabPool &) = delete;
+
+    void* allocate(){
+      AsyncWebLockGuard l(_lock);
+      if(_free == NULL && !_grow()){
+        _stats.failures++;
+        return NULL;
+      }
+      FreeItem* f = _free;
+      _free = f->next;
+      if(++_stats.inUse > _stats.highWater)
+        _stats.highWater = _stats.inUse;
+      return f;
+    }
+
+    void deallocate(void* ptr){
+      if(ptr == NULL)
+        return;
+      AsyncWebLockGuard l(_lock);
+      FreeItem* f = (FreeItem*)ptr;
+      f->next = _free;
+      _free = f;
+      _stats.inUse--;
+    }
+
+    //gives all slabs back to the heap, only possible while nothing is in use
+    bool trim(){
+      AsyncWebLockGuard l(_lock);
+      if(_stats.inUse)
+        return false;
+      while(_slabs != NULL){
+        Slab* s = _slabs;
+        _slabs = s->next;
+        free(s);
+      }
+      _free = NULL;
+      _stats.slabs = 0;
+      return true;
+    }
+
+    //a copy taken under the lock, so the counters belong to one moment
+    AsyncWebSlabStats stats() const {
+      AsyncWebLockGuard l(_lock);
+      return _stats;
+    }
+};
+
+/*
+ * POOLED :: Base that routes new/delete of T through a slab pool of its own.
+ * Objects of another size (subclasses) fall back to malloc/free
+ * */
+
+template<typename T>
+class AsyncWebPooled {
+  public:
+#if ASYNCWEBSERVER_SLAB_ALLOCATOR
+    static AsyncWebSlabPool& slabPool(){
+      static AsyncWebSlabPool pool(sizeof(T));
+      return pool;
+    }
+    static AsyncWebSlabStats slabStats(){ return slabPool().stats(); }
+
+    static void* operator new(size_t size) noexcept {
+      if(size != sizeof(T))
+        return malloc(size);
+      return slabPool().allocate();
+    }
+    static void operator delete(void* ptr, size_t size){
+      if(size != sizeof(T))
+        free(ptr);
+      else
+        slabPool().deallocate(ptr);
+    }
+    static void* operator new(size_t size __attribute__((unused)), void* where) noexcept { return where; }
+    static void operator delete(void* ptr __attribute__((unused)), void* where __attribute__((unused))) {}
+#else
+    static AsyncWebSlabStats slabStats(){ return AsyncWebSlabStats{0, 0, 0, 0}; }
+#endif
+};
+
+#endif /* ASYNCWEBSLAB_H_ */
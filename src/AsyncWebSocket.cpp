@@ -21,27 +21,108 @@
 #include "Arduino.h"
 #include "AsyncWebSocket.h"
 
-#include <libb64/cencode.h>
-
-#ifndef ESP8266
-extern "C" {
-typedef struct {
-    uint32_t state[5];
-    uint32_t count[2];
-    unsigned char buffer[64];
-} SHA1_CTX;
-
-void SHA1Transform(uint32_t state[5], const unsigned char buffer[64]);
-void SHA1Init(SHA1_CTX* context);
-void SHA1Update(SHA1_CTX* context, const unsigned char* data, uint32_t len);
-void SHA1Final(unsigned char digest[20], SHA1_CTX* context);
-}
-#else
-#include <Hash.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
 #endif
 
 #define MAX_PRINTF_LEN 64
 
+typedef uint32_t __attribute__((__may_alias__)) ws_mask_word_t;
+
+//xors data with the 4 byte mask key, the first byte lining up with key position offset
+void webSocketMask(uint8_t *data, size_t len, const uint8_t *mask, size_t offset){
+  uint8_t key[4];
+  size_t i = 0;
+  for(uint8_t k = 0; k < 4; k++)
+    key[k] = mask[(offset + k) & 3];
+  //bytes up to the first word boundary
+  while(i < len && ((uintptr_t)(data + i) & 3)){
+    data[i] ^= key[i & 3];
+    i++;
+  }
+  if(i == len)
+    return;
+  uint8_t rkey[4];
+  for(uint8_t k = 0; k < 4; k++)
+    rkey[k] = key[(i + k) & 3];
+  uint32_t word;
+  memcpy(&word, rkey, 4);
+  uint8_t *p = data + i;
+  size_t left = len - i;
+#if defined(__SSE2__)
+  const __m128i vkey = _mm_set1_epi32((int)word);
+  for(; left >= 16; p += 16, left -= 16)
+    _mm_storeu_si128((__m128i*)p, _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), vkey));
+#elif defined(__ARM_NEON)
+  const uint8x16_t vkey = vreinterpretq_u8_u32(vdupq_n_u32(word));
+  for(; left >= 16; p += 16, left -= 16)
+    vst1q_u8(p, veorq_u8(vld1q_u8(p), vkey));
+#endif
+  for(; left >= 4; p += 4, left -= 4)
+    *(ws_mask_word_t*)p ^= word;
+  for(uint8_t k = 0; k < left; k++)
+    p[k] ^= rkey[k];
+}
+
+//checks the next piece of a text message (RFC 3629: no overlong forms, surrogates or code points over U+10FFFF)
+bool webSocketValidUtf8(AwsUtf8State *state, const uint8_t *data, size_t len){
+  const uint8_t *p = data;
+  const uint8_t *end = data + len;
+  while(p < end){
+    if(!state->need){
+      //ASCII runs a word (or vector) at a time
+      while(p < end && ((uintptr_t)p & 3) && *p < 0x80)
+        p++;
+      //a non-ASCII byte may have stopped the loop above short of the boundary
+      if(!((uintptr_t)p & 3)){
+#if defined(__SSE2__)
+        while(end - p >= 16 && !_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)p)))
+          p += 16;
+#elif defined(__ARM_NEON)
+        while(end - p >= 16){
+          const uint64x2_t v = vreinterpretq_u64_u8(vld1q_u8(p));
+          if((vgetq_lane_u64(v, 0) | vgetq_lane_u64(v, 1)) & 0x8080808080808080ULL)
+            break;
+          p += 16;
+        }
+#endif
+        while(end - p >= 4 && !(*(const ws_mask_word_t*)p & 0x80808080))
+          p += 4;
+      }
+      while(p < end && *p < 0x80)
+        p++;
+      if(p == end)
+        return true;
+      const uint8_t c = *p++;
+      state->lower = 0x80;
+      state->upper = 0xBF;
+      if(c >= 0xC2 && c <= 0xDF){
+        state->need = 1;
+      } else if(c >= 0xE0 && c <= 0xEF){
+        state->need = 2;
+        if(c == 0xE0) state->lower = 0xA0;
+        else if(c == 0xED) state->upper = 0x9F;
+      } else if(c >= 0xF0 && c <= 0xF4){
+        state->need = 3;
+        if(c == 0xF0) state->lower = 0x90;
+        else if(c == 0xF4) state->upper = 0x8F;
+      } else {
+        return false;
+      }
+      continue;
+    }
+    const uint8_t c = *p++;
+    if(c < state->lower || c > state->upper)
+      return false;
+    state->need--;
+    state->lower = 0x80;
+    state->upper = 0xBF;
+  }
+  return true;
+}
+
 size_t webSocketSendFrameWindow(AsyncClient *client){
   if(!client->canSend())
     return 0;
@@ -51,7 +132,7 @@ size_t webSocketSendFrameWindow(AsyncClient *client){
   return space - 8;
 }
 
-size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool mask, uint8_t *data, size_t len){
+size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool mask, uint8_t *data, size_t len, bool rsv1 = false, bool copy = true){
   if(!client->canSend()) {
     // Serial.println("SF 1");
     return 0;
@@ -80,16 +161,13 @@ size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool
 
   if(len > space) len = space;
 
-  uint8_t *buf = (uint8_t*)malloc(headLen);
-  if(buf == NULL){
-    //os_printf("could not malloc %u bytes for frame header\n", headLen);
-    // Serial.println("SF 3");
-    return 0;
-  }
+  uint8_t buf[8];
 
   buf[0] = opcode & 0x0F;
   if(final)
     buf[0] |= 0x80;
+  if(rsv1)
+    buf[0] |= 0x40;
   if(len < 126)
     buf[1] = len & 0x7F;
   else {
@@ -101,31 +179,23 @@ size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool
     buf[1] |= 0x80;
     memcpy(buf + (headLen - 4), mbuf, 4);
   }
-  if(client->add((const char *)buf, headLen) != headLen){
+  if(client->add((const char *)buf, headLen, ASYNC_WRITE_FLAG_COPY) != headLen){
     //os_printf("error adding %lu header bytes\n", headLen);
-    free(buf);
     // Serial.println("SF 4");
     return 0;
   }
-  free(buf);
 
   if(len){
     if(len && mask){
-      size_t i;
-      for(i=0;i<len;i++)
-        data[i] = data[i] ^ mbuf[i%4];
+      webSocketMask(data, len, mbuf, 0);
     }
-    if(client->add((const char *)data, len) != len){
+    if(client->add((const char *)data, len, copy ? ASYNC_WRITE_FLAG_COPY : 0) != len){
       //os_printf("error adding %lu data bytes\n", len);
       // Serial.println("SF 5");
       return 0;
     }
   }
-  if(!client->send()){
-    //os_printf("error sending frame: %lu\n", headLen+len);
-    // Serial.println("SF 6");
-    return 0;
-  }
+  //the caller flushes once for all frames it added
   // Serial.println("SF");
   return len;
 }
@@ -138,126 +208,540 @@ size_t webSocketSendFrame(AsyncClient *client, bool final, uint8_t opcode, bool
 
 
 AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer()
-  :_data(nullptr)
+  :_buffer(nullptr)
+  ,_data(nullptr)
   ,_len(0)
   ,_lock(false)
   ,_count(0)
+  ,_frameOpcode(0)
+  ,_frameHeadLen(0)
+  ,_compressed(false)
+  ,_deflated(nullptr)
+  ,_deflatedBits(0)
+  ,_key(0)
+  ,_priority(WS_PRIORITY_NORMAL)
+  ,_capacity(0)
+  ,_pool(nullptr)
+  ,_nextFree(nullptr)
+  ,_prevLive(nullptr)
+  ,_nextLive(nullptr)
 {
 
 }
 
 AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(uint8_t * data, size_t size)
-  :_data(nullptr)
+  :_buffer(nullptr)
+  ,_data(nullptr)
   ,_len(size)
   ,_lock(false)
   ,_count(0)
+  ,_frameOpcode(0)
+  ,_frameHeadLen(0)
+  ,_compressed(false)
+  ,_deflated(nullptr)
+  ,_deflatedBits(0)
+  ,_key(0)
+  ,_priority(WS_PRIORITY_NORMAL)
+  ,_capacity(0)
+  ,_pool(nullptr)
+  ,_nextFree(nullptr)
+  ,_prevLive(nullptr)
+  ,_nextLive(nullptr)
 {
 
   if (!data) {
     return;
   }
 
-  _data = new uint8_t[_len + 1];
-
-  if (_data) {
+  if (_allocate(_len)) {
     // Serial.println("BUFF alloc");
     memcpy(_data, data, _len);
-    _data[_len] = 0;
   }
 }
 
 
 AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(size_t size)
-  :_data(nullptr)
+  :_buffer(nullptr)
+  ,_data(nullptr)
   ,_len(size)
   ,_lock(false)
   ,_count(0)
+  ,_frameOpcode(0)
+  ,_frameHeadLen(0)
+  ,_compressed(false)
+  ,_deflated(nullptr)
+  ,_deflatedBits(0)
+  ,_key(0)
+  ,_priority(WS_PRIORITY_NORMAL)
+  ,_capacity(0)
+  ,_pool(nullptr)
+  ,_nextFree(nullptr)
+  ,_prevLive(nullptr)
+  ,_nextLive(nullptr)
 {
-  _data = new uint8_t[_len + 1];
-
-  if (_data) {
-    // Serial.println("BUFF alloc");
-    _data[_len] = 0;
-  }
-
+  _allocate(_len);
 }
 
 AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(const AsyncWebSocketMessageBuffer & copy)
-  :_data(nullptr)
+  :_buffer(nullptr)
+  ,_data(nullptr)
   ,_len(0)
   ,_lock(false)
   ,_count(0)
+  ,_frameOpcode(0)
+  ,_frameHeadLen(0)
+  ,_compressed(false)
+  ,_deflated(nullptr)
+  ,_deflatedBits(0)
+  ,_key(0)
+  ,_priority(WS_PRIORITY_NORMAL)
+  ,_capacity(0)
+  ,_pool(nullptr)
+  ,_nextFree(nullptr)
+  ,_prevLive(nullptr)
+  ,_nextLive(nullptr)
 {
   _len = copy._len;
   _lock = copy._lock;
   _count = 0;
+  _key = copy._key;
+  _priority = copy._priority;
 
-  if (_len) {
-    _data = new uint8_t[_len + 1];
-    _data[_len] = 0;
-  }
-
-  if (_data) {
+  if (_len && _allocate(_len)) {
     // Serial.println("BUFF alloc");
     memcpy(_data, copy._data, _len);
-    _data[_len] = 0;
   }
 
 }
 
 AsyncWebSocketMessageBuffer::AsyncWebSocketMessageBuffer(AsyncWebSocketMessageBuffer && copy)
-  :_data(nullptr)
+  :_buffer(nullptr)
+  ,_data(nullptr)
   ,_len(0)
   ,_lock(false)
   ,_count(0)
+  ,_frameOpcode(0)
+  ,_frameHeadLen(0)
+  ,_compressed(false)
+  ,_deflated(nullptr)
+  ,_deflatedBits(0)
+  ,_key(0)
+  ,_priority(WS_PRIORITY_NORMAL)
+  ,_capacity(0)
+  ,_pool(nullptr)
+  ,_nextFree(nullptr)
+  ,_prevLive(nullptr)
+  ,_nextLive(nullptr)
 {
   _len = copy._len;
   _lock = copy._lock;
   _count = 0;
+  _key = copy._key;
+  _priority = copy._priority;
 
-  if (copy._data) {
+  if (copy._buffer) {
     // Serial.println("BUFF alloc");
+    _buffer = copy._buffer;
     _data = copy._data;
+    _capacity = copy._capacity;
+    _frameOpcode = copy._frameOpcode;
+    _frameHeadLen = copy._frameHeadLen;
+    copy._buffer = nullptr;
     copy._data = nullptr;
   }
+  _compressed = copy._compressed;
+  _deflated = copy._deflated;
+  _deflatedBits = copy._deflatedBits;
+  copy._deflated = nullptr;
 
 }
 
 AsyncWebSocketMessageBuffer::~AsyncWebSocketMessageBuffer()
 {
-    if (_data) {
+    if (_buffer) {
       // Serial.println("BUFF free");
-      delete[] _data;
+      delete[] _buffer;
+    }
+    if (_deflated) {
+      delete _deflated;
+    }
+}
+
+bool AsyncWebSocketMessageBuffer::_allocate(size_t size)
+{
+  _buffer = new uint8_t[WS_FRAME_HEADROOM + size + 1];
+  if (!_buffer) {
+    _data = nullptr;
+    return false;
+  }
+  _data = _buffer + WS_FRAME_HEADROOM;
+  _data[size] = 0;
+  _frameHeadLen = 0;
+  _capacity = size;
+  return true;
+}
+
+void AsyncWebSocketMessageBuffer::_reset(size_t size)
+{
+  _len = size;
+  _data[size] = 0;
+  _lock = false;
+  _count = 0;
+  _frameOpcode = 0;
+  _frameHeadLen = 0;
+  _compressed = false;
+  if (_deflated) {
+    delete _deflated;
+    _deflated = nullptr;
+  }
+  _deflatedBits = 0;
+  _key = 0;
+  _priority = WS_PRIORITY_NORMAL;
+}
+
+void AsyncWebSocketMessageBuffer::operator --(int i)
+{
+  (void)i;
+  if (_count > 0) {
+    _count--;
+    if (!_count && !_lock && _pool) {
+      _pool->release(this);
     }
+  }
+}
+
+void AsyncWebSocketMessageBuffer::unlock()
+{
+  _lock = false;
+  if (!_count && _pool) {
+    _pool->release(this);
+  }
 }
 
 bool AsyncWebSocketMessageBuffer::reserve(size_t size)
 {
+  if (_buffer && size <= _capacity) {
+    //big enough already, only the frame and the compressed copy are stale
+    _len = size;
+    _data[size] = 0;
+    _frameHeadLen = 0;
+    if (_deflated) {
+      delete _deflated;
+      _deflated = nullptr;
+    }
+    _deflatedBits = 0;
+    return true;
+  }
+
   _len = size;
 
-  if (_data) {
-    delete[] _data;
+  if (_buffer) {
+    delete[] _buffer;
+    _buffer = nullptr;
     _data = nullptr;
   }
+  if (_deflated) {
+    delete _deflated;
+    _deflated = nullptr;
+  }
+  _deflatedBits = 0;
 
-  _data = new uint8_t[_len + 1];
+  return _allocate(_len);
+}
 
-  if (_data) {
-    _data[_len] = 0;
-    return true;
+uint8_t * AsyncWebSocketMessageBuffer::frame(uint8_t opcode)
+{
+  if (!_buffer) {
+    return nullptr;
+  }
+  opcode &= 0x0F;
+  if (_frameHeadLen) {
+    //the header may already be on the wire for other clients, it can not change
+    return (_frameOpcode == opcode) ? (_data - _frameHeadLen) : nullptr;
+  }
+  uint8_t headLen = (_len < 126) ? 2 : ((_len <= 0xFFFF) ? 4 : 10);
+  uint8_t * head = _data - headLen;
+  head[0] = 0x80 | opcode;
+  if (_compressed) {
+    head[0] |= 0x40;
+  }
+  if (_len < 126) {
+    head[1] = _len;
+  } else if (headLen == 4) {
+    head[1] = 126;
+    head[2] = (uint8_t)(_len >> 8);
+    head[3] = (uint8_t)(_len);
   } else {
-    return false;
+    head[1] = 127;
+    uint64_t len = _len;
+    for (int i = 9; i > 1; i--) {
+      head[i] = (uint8_t)(len & 0xFF);
+      len >>= 8;
+    }
+  }
+  _frameOpcode = opcode;
+  _frameHeadLen = headLen;
+  return head;
+}
+
+AsyncWebSocketMessageBuffer * AsyncWebSocketMessageBuffer::deflated(uint8_t windowBits, size_t minSize)
+{
+  if (!_buffer || _compressed || _len < minSize) {
+    return nullptr;
+  }
+  if (!_deflatedBits) {
+    //compressed at most once, the first client decides the window
+    _deflatedBits = windowBits;
+    size_t len = 0;
+    uint8_t * out = AsyncWebSocketDeflate::deflateRaw(_data, _len, &len, windowBits);
+    if (out) {
+      _deflated = new AsyncWebSocketMessageBuffer(out, len);
+      free(out);
+      if (_deflated && !_deflated->_buffer) {
+        delete _deflated;
+        _deflated = nullptr;
+      }
+      if (_deflated) {
+        _deflated->_compressed = true;
+      }
+    }
+  }
+  //a stream made with a smaller window is valid for any larger one
+  return (_deflatedBits <= windowBits) ? _deflated : nullptr;
+}
+
+/*
+ *    AsyncWebSocketBufferPool
+ */
+
+AsyncWebSocketBufferPool::AsyncWebSocketBufferPool()
+  : _live(nullptr)
+{
+  memset(_free, 0, sizeof(_free));
+  memset(_freeCount, 0, sizeof(_freeCount));
+  memset(&_stats, 0, sizeof(_stats));
+}
+
+AsyncWebSocketBufferPool::~AsyncWebSocketBufferPool()
+{
+  for (uint8_t c = 0; c < WS_BUFFER_POOL_CLASSES; c++) {
+    while (_free[c]) {
+      AsyncWebSocketMessageBuffer * buffer = _free[c];
+      _free[c] = buffer->_nextFree;
+      delete buffer;
+    }
+  }
+  //the ones still out are freed by whoever has them
+  for (AsyncWebSocketMessageBuffer * buffer = _live; buffer; buffer = buffer->_nextLive) {
+    buffer->_pool = nullptr;
+  }
+}
+
+AsyncWebSocketMessageBuffer * AsyncWebSocketBufferPool::acquire(size_t size)
+{
+  uint8_t c = 0;
+  while (c < WS_BUFFER_POOL_CLASSES && _classSize(c) < size) {
+    c++;
+  }
+  AsyncWebSocketMessageBuffer * buffer = nullptr;
+  {
+    AsyncWebLockGuard l(_lock);
+    if (c < WS_BUFFER_POOL_CLASSES && _free[c]) {
+      buffer = _free[c];
+      _free[c] = buffer->_nextFree;
+      _freeCount[c]--;
+      _stats.pooled--;
+      _stats.pooledBytes -= buffer->_capacity;
+      _stats.reused++;
+    }
+  }
+  if (!buffer) {
+    buffer = new AsyncWebSocketMessageBuffer();
+    //allocated with the size of its class, so it can serve any request of that class later
+    if (!buffer || !buffer->_allocate((c < WS_BUFFER_POOL_CLASSES) ? _classSize(c) : size)) {
+      delete buffer;
+      return nullptr;
+    }
+  }
+  buffer->_reset(size);
+  buffer->_nextFree = nullptr;
+  buffer->_pool = this;
+  AsyncWebLockGuard l(_lock);
+  buffer->_prevLive = nullptr;
+  buffer->_nextLive = _live;
+  if (_live) {
+    _live->_prevLive = buffer;
+  }
+  _live = buffer;
+  _stats.acquired++;
+  _stats.live++;
+  return buffer;
+}
+
+void AsyncWebSocketBufferPool::release(AsyncWebSocketMessageBuffer * buffer)
+{
+  bool pooled;
+  {
+    AsyncWebLockGuard l(_lock);
+    pooled = _releaseLocked(buffer);
+  }
+  if (!pooled) {
+    delete buffer;
+  }
+}
+
+//with _lock held: takes the buffer off the live list and keeps it for reuse, false when the caller has to delete it
+bool AsyncWebSocketBufferPool::_releaseLocked(AsyncWebSocketMessageBuffer * buffer)
+{
+  //the largest class the buffer can serve
+  int c = -1;
+  if (buffer->_buffer && buffer->_capacity <= _classSize(WS_BUFFER_POOL_CLASSES - 1)) {
+    while (c + 1 < WS_BUFFER_POOL_CLASSES && _classSize(c + 1) <= buffer->_capacity) {
+      c++;
+    }
+  }
+  buffer->_pool = nullptr;
+  if (buffer->_prevLive) {
+    buffer->_prevLive->_nextLive = buffer->_nextLive;
+  } else {
+    _live = buffer->_nextLive;
+  }
+  if (buffer->_nextLive) {
+    buffer->_nextLive->_prevLive = buffer->_prevLive;
+  }
+  buffer->_prevLive = nullptr;
+  buffer->_nextLive = nullptr;
+  _stats.released++;
+  _stats.live--;
+  if (c >= 0 && _freeCount[c] < WS_BUFFER_POOL_MAX_FREE) {
+    buffer->_nextFree = _free[c];
+    _free[c] = buffer;
+    _freeCount[c]++;
+    _stats.pooled++;
+    _stats.pooledBytes += buffer->_capacity;
+    return true;
+  }
+  return false;
+}
+
+void AsyncWebSocketBufferPool::reclaim()
+{
+  AsyncWebLockGuard l(_lock);
+  AsyncWebSocketMessageBuffer * buffer = _live;
+  while (buffer) {
+    AsyncWebSocketMessageBuffer * next = buffer->_nextLive;
+    if (buffer->canDelete() && !_releaseLocked(buffer)) {
+      delete buffer;
+    }
+    buffer = next;
+  }
+}
+
+
+/*
+ *    AsyncWebSocketTimerWheel
+ */
+
+AsyncWebSocketTimerWheel::AsyncWebSocketTimerWheel()
+  : _expired(nullptr)
+  , _tick(0)
+  , _tickTime(0)
+  , _count(0)
+{
+  memset(_wheel, 0, sizeof(_wheel));
+}
+
+void AsyncWebSocketTimerWheel::_link(AsyncWebSocketTimer ** list, AsyncWebSocketTimer * timer)
+{
+  timer->_prev = nullptr;
+  timer->_next = *list;
+  if (*list)
+    (*list)->_prev = timer;
+  *list = timer;
+  timer->_list = list;
+}
+
+void AsyncWebSocketTimerWheel::_place(AsyncWebSocketTimer * timer)
+{
+  int32_t delta = (int32_t)(timer->_deadline - _tick);
+  if (delta < (int32_t)SLOTS) {
+    //a timer that is due while cascading goes to the slot of the current tick, expired right after
+    _link(&_wheel[0][(delta > 0 ? timer->_deadline : _tick) & (SLOTS - 1)], timer);
+    return;
   }
+  //the slot of the current turn was cascaded already, further deadlines wait in the last one and are placed again
+  uint32_t turns = (timer->_deadline >> SLOT_BITS) - (_tick >> SLOT_BITS);
+  if (turns > SLOTS - 1)
+    turns = SLOTS - 1;
+  _link(&_wheel[1][((_tick >> SLOT_BITS) + turns) & (SLOTS - 1)], timer);
+}
 
+void AsyncWebSocketTimerWheel::schedule(AsyncWebSocketTimer * timer, uint32_t ms)
+{
+  const uint32_t now = millis();
+  cancel(timer);
+  if (!_count)
+    _tickTime = now;
+  //counted from the last tick, which may be behind now until the next advance()
+  uint32_t ticks = (now - _tickTime + ms + WS_TIMER_TICK - 1) / WS_TIMER_TICK;
+  timer->_deadline = _tick + (ticks ? ticks : 1);
+  _place(timer);
+  _count++;
+}
+
+void AsyncWebSocketTimerWheel::cancel(AsyncWebSocketTimer * timer)
+{
+  if (!timer->_list)
+    return;
+  if (timer->_prev)
+    timer->_prev->_next = timer->_next;
+  else
+    *timer->_list = timer->_next;
+  if (timer->_next)
+    timer->_next->_prev = timer->_prev;
+  timer->_list = nullptr;
+  _count--;
 }
 
+void AsyncWebSocketTimerWheel::advance(uint32_t now)
+{
+  while (_count && (now - _tickTime) >= WS_TIMER_TICK) {
+    _tickTime += WS_TIMER_TICK;
+    _tick++;
+    if (!(_tick & (SLOTS - 1))) {
+      AsyncWebSocketTimer ** turn = &_wheel[1][(_tick >> SLOT_BITS) & (SLOTS - 1)];
+      AsyncWebSocketTimer * timer = *turn;
+      *turn = nullptr;
+      while (timer) {
+        AsyncWebSocketTimer * next = timer->_next;
+        _place(timer);
+        timer = next;
+      }
+    }
+    AsyncWebSocketTimer ** slot = &_wheel[0][_tick & (SLOTS - 1)];
+    if (!*slot)
+      continue;
+    //the handlers schedule and cancel timers, and may delete their client, so the batch is taken out of the wheel first
+    _expired = *slot;
+    *slot = nullptr;
+    for (AsyncWebSocketTimer * timer = _expired; timer; timer = timer->_next)
+      timer->_list = &_expired;
+    while (_expired) {
+      AsyncWebSocketTimer * timer = _expired;
+      cancel(timer);
+      timer->client->_onTimer();
+    }
+  }
+  if (!_count)
+    _tickTime = now;
+}
 
 
 /*
  * Control Frame
  */
 
-class AsyncWebSocketControl {
+class AsyncWebSocketControl: public AsyncWebPooled<AsyncWebSocketControl> {
   private:
     uint8_t _opcode;
     uint8_t *_data;
@@ -279,7 +763,7 @@ class AsyncWebSocketControl {
         _data = (uint8_t*)malloc(_len);
         if(_data == NULL)
           _len = 0;
-        else memcpy(_data, data, len);
+        else memcpy(_data, data, _len);
       } else _data = NULL;
     }
     virtual ~AsyncWebSocketControl(){
@@ -382,7 +866,7 @@ AsyncWebSocketBasicMessage::~AsyncWebSocketBasicMessage() {
   uint8_t* dPtr = (uint8_t*)(_data + (_sent - toSend));
   uint8_t opCode = (toSend && _sent == toSend)?_opcode:(uint8_t)WS_CONTINUATION;
 
-  size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend);
+  size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend, _compressed && opCode != WS_CONTINUATION);
   _status = WS_MSG_SENDING;
   if(toSend && sent != toSend){
       size_t delta = (toSend - sent);
@@ -397,6 +881,19 @@ AsyncWebSocketBasicMessage::~AsyncWebSocketBasicMessage() {
   return sent;
 }
 
+void AsyncWebSocketBasicMessage::deflate(AsyncWebSocketDeflate *deflate)  {
+  if(_status != WS_MSG_SENDING || _sent)
+    return;
+  size_t len = 0;
+  uint8_t * out = deflate->deflate(_data, _len, &len);
+  if(out == NULL)
+    return;
+  free(_data);
+  _data = out;
+  _len = len;
+  _compressed = true;
+}
+
 // bool AsyncWebSocketBasicMessage::reserve(size_t size) {
 //   if (size) {
 //     _data = (uint8_t*)malloc(size +1);
@@ -421,6 +918,8 @@ AsyncWebSocketMultiMessage::AsyncWebSocketMultiMessage(AsyncWebSocketMessageBuff
   ,_sent(0)
   ,_ack(0)
   ,_acked(0)
+  ,_framed(false)
+  ,_owned(nullptr)
   ,_WSbuffer(nullptr)
 {
 
@@ -430,9 +929,17 @@ AsyncWebSocketMultiMessage::AsyncWebSocketMultiMessage(AsyncWebSocketMessageBuff
   if (buffer) {
     _WSbuffer = buffer;
     (*_WSbuffer)++;
+    _key = buffer->key();
+    _priority = buffer->priority();
     //  Serial.printf("INC WSbuffer == %u\n", _WSbuffer->count());
-    _data = buffer->get();
-    _len = buffer->length();
+    _data = mask ? nullptr : buffer->frame(_opcode);
+    if (_data) {
+      _framed = true;
+      _len = buffer->frameLength();
+    } else {
+      _data = buffer->get();
+      _len = buffer->length();
+    }
     _status = WS_MSG_SENDING;
     //ets_printf("M: %u\n", _len);
   } else {
@@ -448,6 +955,9 @@ AsyncWebSocketMultiMessage::~AsyncWebSocketMultiMessage() {
     (*_WSbuffer)--; // decreases the counter.
     // Serial.printf("DEC WSbuffer == %u\n", _WSbuffer->count());
   }
+  if (_owned) {
+    free(_owned);
+  }
 }
 
  void AsyncWebSocketMultiMessage::ack(size_t len, uint32_t time)  {
@@ -480,6 +990,8 @@ AsyncWebSocketMultiMessage::~AsyncWebSocketMultiMessage() {
       //ets_printf("E: %u > %u\n", _sent, _len);
       return 0;
   }
+  if(_framed)
+    return _sendFrame(client);
   size_t toSend = _len - _sent;
   size_t window = webSocketSendFrameWindow(client);
   // Serial.printf("Send %u %u %u\n", _len, _sent, toSend);
@@ -497,7 +1009,7 @@ AsyncWebSocketMultiMessage::~AsyncWebSocketMultiMessage() {
   uint8_t* dPtr = (uint8_t*)(_data + (_sent - toSend));
   uint8_t opCode = (toSend && _sent == toSend)?_opcode:(uint8_t)WS_CONTINUATION;
 
-  size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend);
+  size_t sent = webSocketSendFrame(client, final, opCode, _mask, dPtr, toSend, _compressed && opCode != WS_CONTINUATION);
   _status = WS_MSG_SENDING;
   if(toSend && sent != toSend){
       //ets_printf("E: %u != %u\n", toSend, sent);
@@ -514,16 +1026,222 @@ AsyncWebSocketMultiMessage::~AsyncWebSocketMultiMessage() {
   return sent;
 }
 
+void AsyncWebSocketMultiMessage::deflate(AsyncWebSocketDeflate *deflate)  {
+  if(_status != WS_MSG_SENDING || _sent || !_WSbuffer)
+    return;
+  if(!deflate->contextTakeover()){
+    //no state between messages, so every such client can get the same compressed frame
+    AsyncWebSocketMessageBuffer * compressed = _WSbuffer->deflated(deflate->windowBits(), deflate->minSize());
+    if(compressed){
+      _compressed = true;
+      _data = _mask ? nullptr : compressed->frame(_opcode);
+      _framed = (_data != nullptr);
+      if(_framed){
+        _len = compressed->frameLength();
+      } else {
+        _data = compressed->get();
+        _len = compressed->length();
+      }
+      return;
+    }
+    //too short or incompressible, unless the shared copy only needs a larger window than this client has
+    if(!_WSbuffer->_deflated)
+      return;
+  }
+  size_t len = 0;
+  _owned = deflate->deflate(_WSbuffer->get(), _WSbuffer->length(), &len);
+  if(_owned == NULL)
+    return;
+  _data = _owned;
+  _len = len;
+  _framed = false;
+  _compressed = true;
+}
+
+//hands the shared frame to the TCP stack without copying, the buffer outlives the acks
+size_t AsyncWebSocketMultiMessage::_sendFrame(AsyncClient *client)  {
+  if(!client->canSend())
+    return 0;
+  size_t toSend = _len - _sent;
+  size_t space = client->space();
+  if(space < toSend)
+    toSend = space;
+  if(!toSend)
+    return 0;
+  size_t added = client->add((const char *)(_data + _sent), toSend, 0);
+  if(!added){
+    if(!_sent)
+      _status = WS_MSG_ERROR;
+    return 0;
+  }
+  _sent += added;
+  _ack += added;
+  return added;
+}
+
+
+/*
+ * Stream Message
+ */
+
+AsyncWebSocketStreamMessage::AsyncWebSocketStreamMessage(fs::File file, uint8_t opcode, size_t chunk)
+  :_file(file)
+  ,_filler(nullptr)
+  ,_len(0)
+  ,_index(0)
+  ,_chunk(chunk)
+  ,_buffer(nullptr)
+  ,_ack(0)
+  ,_acked(0)
+  ,_ended(false)
+{
+  _opcode = opcode & 0x07;
+  if(_file){
+    _len = _file.size();
+    _status = WS_MSG_SENDING;
+  }
+}
+
+AsyncWebSocketStreamMessage::AsyncWebSocketStreamMessage(AwsResponseFiller filler, size_t len, uint8_t opcode, size_t chunk)
+  :_filler(filler)
+  ,_len(len)
+  ,_index(0)
+  ,_chunk(chunk)
+  ,_buffer(nullptr)
+  ,_ack(0)
+  ,_acked(0)
+  ,_ended(false)
+{
+  _opcode = opcode & 0x07;
+  if(_filler)
+    _status = WS_MSG_SENDING;
+}
+
+AsyncWebSocketStreamMessage::~AsyncWebSocketStreamMessage() {
+  if(_buffer)
+    free(_buffer);
+  if(_file)
+    _file.close();
+}
+
+void AsyncWebSocketStreamMessage::ack(size_t len, uint32_t time)  {
+  (void)time;
+  _acked += len;
+  if(_ended && _acked >= _ack)
+    _status = WS_MSG_SENT;
+}
+
+size_t AsyncWebSocketStreamMessage::send(AsyncClient *client)  {
+  if(_status != WS_MSG_SENDING || _ended)
+    return 0;
+  size_t toRead = webSocketSendFrameWindow(client);
+  if(!toRead)
+    return 0;
+  if(toRead > _chunk)
+    toRead = _chunk;
+  if(_len && toRead > _len - _index)
+    toRead = _len - _index;
+  if(_buffer == nullptr){
+    _buffer = (uint8_t*)malloc(_chunk);
+    if(_buffer == nullptr){
+      //nothing is on the wire yet, the message can still go away whole
+      _status = WS_MSG_ERROR;
+      return 0;
+    }
+  }
+  size_t got = 0;
+  if(toRead){
+    got = _filler ? _filler(_buffer, toRead, _index) : _file.read(_buffer, toRead);
+    if(got == RESPONSE_TRY_AGAIN)
+      return 0;
+    if(got > toRead)
+      got = toRead;
+  }
+  //a source that ends early finishes the message with what it gave
+  const bool final = !got || (_len && _index + got == _len);
+  const uint8_t opcode = _ack ? (uint8_t)WS_CONTINUATION : _opcode;
+  size_t sent = webSocketSendFrame(client, final, opcode, false, _buffer, got);
+  if(sent != got){
+    _status = WS_MSG_ERROR;
+    return 0;
+  }
+  _index += got;
+  _ack += got + ((got < 126) ? 2 : 4);
+  if(final){
+    _ended = true;
+    free(_buffer);
+    _buffer = nullptr;
+  }
+  return got;
+}
+
+
+/*
+ * Reference Message
+ */
+
+AsyncWebSocketRefMessage::AsyncWebSocketRefMessage(const uint8_t * data, size_t len, uint8_t opcode, AwsMessageReleaseHandler onRelease)
+  :_data(data)
+  ,_len(len)
+  ,_sent(0)
+  ,_ack(0)
+  ,_acked(0)
+  ,_onRelease(onRelease)
+{
+  _opcode = opcode & 0x07;
+  if(_data && _len)
+    _status = WS_MSG_SENDING;
+}
+
+AsyncWebSocketRefMessage::~AsyncWebSocketRefMessage() {
+  //the TCP stack is done with the memory: the message was acked, never sent, the connection was aborted,
+  //or the peer closed it WS_ZERO_COPY_LINGER ms ago
+  if(_onRelease)
+    _onRelease(_status == WS_MSG_SENT);
+}
+
+void AsyncWebSocketRefMessage::ack(size_t len, uint32_t time)  {
+  (void)time;
+  _acked += len;
+  if(_sent == _len && _acked >= _ack)
+    _status = WS_MSG_SENT;
+}
+
+size_t AsyncWebSocketRefMessage::send(AsyncClient *client)  {
+  if(_status != WS_MSG_SENDING || _sent == _len)
+    return 0;
+  size_t toSend = _len - _sent;
+  size_t window = webSocketSendFrameWindow(client);
+  if(window < toSend)
+    toSend = window;
+  if(!toSend)
+    return 0;
+  const bool final = (_sent + toSend == _len);
+  const uint8_t opcode = _sent ? (uint8_t)WS_CONTINUATION : _opcode;
+  size_t sent = webSocketSendFrame(client, final, opcode, false, (uint8_t *)(_data + _sent), toSend, false, false);
+  if(sent != toSend){
+    if(!_sent)
+      _status = WS_MSG_ERROR;
+    return 0;
+  }
+  _sent += toSend;
+  _ack += toSend + ((toSend < 126) ? 2 : 4);
+  return toSend;
+}
+
 
 /*
  * Async WebSocket Client
  */
  const char * AWSC_PING_PAYLOAD = "ESPAsyncWebServer-PING";
  const size_t AWSC_PING_PAYLOAD_LEN = 22;
+ //measuring pings carry a 4 byte sequence number and the 4 byte micros() they were sent at after the text
+ const size_t AWSC_RTT_PAYLOAD_LEN = AWSC_PING_PAYLOAD_LEN + 8;
 
-AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest *request, AsyncWebSocket *server)
+AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest *request, AsyncWebSocket *server, AsyncWebSocketDeflate *deflate, size_t handshakeLen)
   : _controlQueue(LinkedList<AsyncWebSocketControl *>([](AsyncWebSocketControl *c){ delete  c; }))
-  , _messageQueue(LinkedList<AsyncWebSocketMessage *>([](AsyncWebSocketMessage *m){ delete  m; }))
+  , _messageQueue(LinkedList<AsyncWebSocketMessage *>([this](AsyncWebSocketMessage *m){ _releaseMessage(m); }))
+  , _timer(this)
   , _tempObject(NULL)
 {
   _client = request->client();
@@ -531,8 +1249,32 @@ AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest *request, Async
   _clientId = _server->_getNextId();
   _status = WS_CONNECTED;
   _pstate = 0;
+  _pheadLen = 0;
+  _pcontrol = NULL;
+  _queuedBytes = 0;
+  memset(&_queueStats, 0, sizeof(_queueStats));
+  _unackedHead = 0;
+  _unackedCount = 0;
+  _handshakeUnacked = handshakeLen;
+  _pcompressed = false;
+  _putf8 = false;
+  _priority = WS_PRIORITY_NORMAL;
+  memset(&_utf8, 0, sizeof(_utf8));
+  _assembly = NULL;
+  _assemblyLen = 0;
+  _deflate = deflate;
   _lastMessageTime = millis();
-  _keepAlivePeriod = 0;
+  _keepAlivePeriod = server->keepAlive() * 1000;
+  _pingTime = _lastMessageTime;
+  _pongPending = false;
+  _pingSeq = 0;
+  _rtt = 0;
+  _rttJitter = 0;
+  _drainPending = false;
+  _closing = false;
+  _closeTime = 0;
+  _aborted = false;
+  _lingering = false;
   _client->setRxTimeout(0);
   _client->onError([](void *r, AsyncClient* c, int8_t error){ (void)c; ((AsyncWebSocketClient*)(r))->_onError(error); }, this);
   _client->onAck([](void *r, AsyncClient* c, size_t len, uint32_t time){ (void)c; ((AsyncWebSocketClient*)(r))->_onAck(len, time); }, this);
@@ -541,82 +1283,307 @@ AsyncWebSocketClient::AsyncWebSocketClient(AsyncWebServerRequest *request, Async
   _client->onData([](void *r, AsyncClient* c, void *buf, size_t len){ (void)c; ((AsyncWebSocketClient*)(r))->_onData(buf, len); }, this);
   _client->onPoll([](void *r, AsyncClient* c){ (void)c; ((AsyncWebSocketClient*)(r))->_onPoll(); }, this);
   _server->_addClient(this);
-  _server->_handleEvent(this, WS_EVT_CONNECT, request, NULL, 0);
-  delete request;
   memset(&_pinfo,0,sizeof(_pinfo));
+  _armTimer();
+  //frames that came with the request are parsed once it is released
+  request->_handOver([](void *r, AsyncClient* c, void *buf, size_t len){ (void)c; ((AsyncWebSocketClient*)(r))->_onData(buf, len); }, this);
+  _server->_handleEvent(this, WS_EVT_CONNECT, request, NULL, 0);
 }
 
 AsyncWebSocketClient::~AsyncWebSocketClient(){
   // Serial.printf("%u FREE Q\n", id());
+  _server->_timerWheel().cancel(&_timer);
+  _server->_queueRemove(_queuedBytes);
+  //what is still queued is reported as dropped, and whatever the handlers send now is dropped too
+  _status = WS_DISCONNECTED;
   _messageQueue.free();
   _controlQueue.free();
-  _server->_cleanBuffers();
+  if(_pcontrol != NULL)
+    free(_pcontrol);
+  if(_deflate != NULL)
+    delete _deflate;
+  if(_assembly != NULL)
+    _server->_releaseBuffer(_assembly);
   _server->_handleEvent(this, WS_EVT_DISCONNECT, NULL, NULL, 0);
 }
 
+bool AsyncWebSocketClient::_inFlight(){
+  for(const auto& m: _messageQueue){
+    if(m->inFlight())
+      return true;
+  }
+  return false;
+}
+
+//memory the TCP stack may still retransmit from stays with the socket, everything else goes now
+void AsyncWebSocketClient::_releaseMessage(AsyncWebSocketMessage *message){
+  if(_lingering && message->inFlight()){
+    _server->_retire(message);
+    return;
+  }
+  message->_released();
+  delete message;
+}
+
 void AsyncWebSocketClient::_clearQueue(){
   while(!_messageQueue.isEmpty() && _messageQueue.front()->finished()){
-    _messageQueue.remove(_messageQueue.front());
+    AsyncWebSocketMessage *message = _messageQueue.front();
+    size_t size = message->size();
+    //frames of the message may still be on the wire, their acks must not reach a message allocated at the same address
+    for(uint8_t i = 0; i < _unackedCount; i++){
+      AckEntry &entry = _unacked[(_unackedHead + i) % WS_MAX_UNACKED_FRAMES];
+      if(entry.message == message)
+        entry.message = NULL;
+    }
+    _messageQueue.remove(message);
+    _queuedBytes -= size;
+    _server->_queueRemove(size);
   }
 }
 
 void AsyncWebSocketClient::_onAck(size_t len, uint32_t time){
   // Serial.printf("%u onAck\n", id());
   _lastMessageTime = millis();
-  if(!_controlQueue.isEmpty()){
-    auto head = _controlQueue.front();
-    if(head->finished()){
-      len -= head->len();
-      if(_status == WS_DISCONNECTING && head->opcode() == WS_DISCONNECT){
+  //the handshake went out before any frame
+  const size_t head = std::min(len, _handshakeUnacked);
+  _handshakeUnacked -= head;
+  len -= head;
+  //one ack may cover several frames, hand each its share in the order they were sent
+  while(_unackedCount && (len || !_unacked[_unackedHead].len)){
+    AckEntry &entry = _unacked[_unackedHead];
+    size_t acked = std::min(len, entry.len);
+    entry.len -= acked;
+    len -= acked;
+    if(!entry.control){
+      if(acked && entry.message != NULL)
+        entry.message->ack(acked, time);
+      if(entry.len)
+        break;
+      _clearQueue();
+    } else {
+      if(entry.len)
+        break;
+      auto head = _controlQueue.front();
+      if(head != NULL && head->finished()){
+        if(_status == WS_DISCONNECTING && head->opcode() == WS_DISCONNECT){
+          _controlQueue.remove(head);
+          _status = WS_DISCONNECTED;
+          _closeNow();
+          return;
+        }
         _controlQueue.remove(head);
-        _status = WS_DISCONNECTED;
-        _client->close(true);
-        return;
       }
-      _controlQueue.remove(head);
     }
-  }
-
-  if(len && !_messageQueue.isEmpty()){
-    _messageQueue.front()->ack(len, time);
+    _unackedHead = (_unackedHead + 1) % WS_MAX_UNACKED_FRAMES;
+    _unackedCount--;
   }
 
   _clearQueue();
 
-  _server->_cleanBuffers();
   // Serial.println("RUN 1");
   _runQueue();
+
+  if(_drainPending && _messageQueue.isEmpty() && !_unackedCount){
+    _drainPending = false;
+    _server->_handleDrain(this);
+  }
 }
 
 void AsyncWebSocketClient::_onPoll(){
   if(_client->canSend() && (!_controlQueue.isEmpty() || !_messageQueue.isEmpty())){
     // Serial.println("RUN 2");
     _runQueue();
-  } else if(_keepAlivePeriod > 0 && _controlQueue.isEmpty() && _messageQueue.isEmpty() && (millis() - _lastMessageTime) >= _keepAlivePeriod){
-    ping((uint8_t *)AWSC_PING_PAYLOAD, AWSC_PING_PAYLOAD_LEN);
   }
+  _server->_reapRetired();
+  //every client polls, the first one in a tick moves the timers of all. Last, as it may close this client
+  _server->_timerWheel().advance(millis());
+}
+
+void AsyncWebSocketClient::keepAlivePeriod(uint16_t seconds){
+  _keepAlivePeriod = seconds * 1000;
+  _armTimer();
+}
+
+//the nearest of the keep-alive, pong and idle deadlines. Receiving data does not move the timer, it is checked when it fires
+void AsyncWebSocketClient::_armTimer(){
+  AsyncWebSocketTimerWheel &timers = _server->_timerWheel();
+  const uint32_t now = millis();
+  auto until = [now](uint32_t since, uint32_t period) -> uint32_t {
+    uint32_t passed = now - since;
+    return (passed >= period) ? 0 : period - passed;
+  };
+  if(_closing){
+    timers.schedule(&_timer, until(_closeTime, (_server->pongTimeout() ? _server->pongTimeout() : WS_PONG_TIMEOUT) * 1000UL));
+    return;
+  }
+  if(_status != WS_CONNECTED){
+    timers.cancel(&_timer);
+    return;
+  }
+  uint32_t wait = UINT32_MAX;
+  if(_pongPending){
+    wait = until(_pingTime, _server->pongTimeout() * 1000UL);
+  } else if(_keepAlivePeriod){
+    //a period after the last ping at the earliest, even if that one got no answer
+    wait = until(((int32_t)(_pingTime - _lastMessageTime) > 0) ? _pingTime : _lastMessageTime, _keepAlivePeriod);
+  }
+  if(_server->idleTimeout())
+    wait = std::min(wait, until(_lastMessageTime, _server->idleTimeout() * 1000UL));
+  if(wait == UINT32_MAX)
+    timers.cancel(&_timer);
+  else
+    timers.schedule(&_timer, wait);
+}
+
+void AsyncWebSocketClient::_onTimer(){
+  if(_client == NULL || _status == WS_DISCONNECTED)
+    return;
+  const uint32_t now = millis();
+  if(_closing){
+    //the peer never finished the close handshake
+    _closeNow();
+    return;
+  }
+  if(_status != WS_CONNECTED)
+    return;
+  if(_pongPending && (now - _pingTime) >= _server->pongTimeout() * 1000UL){
+    //no pong and no close either: the peer is gone without closing the connection
+    _closeNow();
+    return;
+  }
+  if(_server->idleTimeout() && (now - _lastMessageTime) >= _server->idleTimeout() * 1000UL){
+    close(1000);
+    return;
+  }
+  const uint32_t since = ((int32_t)(_pingTime - _lastMessageTime) > 0) ? _pingTime : _lastMessageTime;
+  if(_keepAlivePeriod && !_pongPending && (now - since) >= _keepAlivePeriod){
+    measureRtt();
+    _pingTime = now;
+    _pongPending = _server->pongTimeout() != 0;
+  }
+  _armTimer();
+}
+
+void AsyncWebSocketClient::_addUnacked(AsyncWebSocketMessage *message, size_t len){
+  if(_unackedCount){
+    AckEntry &last = _unacked[(_unackedHead + _unackedCount - 1) % WS_MAX_UNACKED_FRAMES];
+    if(message != NULL && last.message == message){
+      last.len += len;
+      return;
+    }
+  }
+  AckEntry &entry = _unacked[(_unackedHead + _unackedCount) % WS_MAX_UNACKED_FRAMES];
+  entry.message = message;
+  entry.control = (message == NULL);
+  entry.len = len;
+  _unackedCount++;
 }
 
+//adds as many frames as fit in the TCP window and sends them at once
 void AsyncWebSocketClient::_runQueue(){
   _clearQueue();
 
-  //size_t m0 = _messageQueue.isEmpty()? 0 : _messageQueue.length();
-  //size_t m1 = _messageQueue.isEmpty()? 0 : _messageQueue.front()->betweenFrames();
-  // Serial.printf("%u R C = %u %u\n", _clientId, m0, m1);
-  if(!_controlQueue.isEmpty() && (_messageQueue.isEmpty() || _messageQueue.front()->betweenFrames()) && webSocketSendFrameWindow(_client) > (size_t)(_controlQueue.front()->len() - 1)){
-    //  Serial.printf("%u R S C\n", _clientId);
-    _controlQueue.front()->send(_client);
-  } else if(!_messageQueue.isEmpty() && _messageQueue.front()->betweenFrames() && webSocketSendFrameWindow(_client)){
-    //  Serial.printf("%u R S M = ", _clientId);
-    _messageQueue.front()->send(_client);
+  bool added = false;
+  while(_unackedCount < WS_MAX_UNACKED_FRAMES && _client->canSend()){
+    //the first message not yet on the wire completely, frames of different messages may not interleave
+    AsyncWebSocketMessage *message = NULL;
+    for(const auto& m: _messageQueue){
+      if(!m->finished() && !m->written()){
+        message = m;
+        break;
+      }
+    }
+    AsyncWebSocketControl *control = NULL;
+    for(const auto& c: _controlQueue){
+      if(!c->finished()){
+        control = c;
+        break;
+      }
+    }
+    size_t space = _client->space();
+    if(control != NULL && (message == NULL || message->betweenFrames()) && webSocketSendFrameWindow(_client) > (size_t)(control->len() - 1)){
+      //  Serial.printf("%u R S C\n", _clientId);
+      control->send(_client);
+      _addUnacked(NULL, space - _client->space());
+    } else if(message != NULL && message->readyToSend() && webSocketSendFrameWindow(_client)){
+      //  Serial.printf("%u R S M = ", _clientId);
+      message->send(_client);
+      size_t len = space - _client->space();
+      if(!len){
+        if(message->finished())
+          continue;
+        break;
+      }
+      _addUnacked(message, len);
+      if(message->written())
+        message->_notify(WS_MSG_EVT_SENT);
+    } else {
+      break;
+    }
+    added = true;
   }
+  if(added)
+    _client->send();
 
   _clearQueue();
 }
 
 bool AsyncWebSocketClient::queueIsFull(){
   if((_messageQueue.length() >= WS_MAX_QUEUED_MESSAGES) || (_status != WS_CONNECTED) ) return true;
-  return false;
+  return !_server->_queueFits(_queuedBytes, 1);
+}
+
+bool AsyncWebSocketClient::_queueFits(size_t size){
+  if(_messageQueue.length() >= WS_MAX_QUEUED_MESSAGES)
+    return false;
+  //a message over the client budget still goes out alone, unless the socket is out of budget already
+  if(_messageQueue.isEmpty())
+    return _server->_queueFits(0, 0);
+  return _server->_queueFits(_queuedBytes, size);
+}
+
+void AsyncWebSocketClient::_dropMessage(AsyncWebSocketMessage *dataMessage, bool conflated){
+  size_t size = dataMessage->size();
+  _messageQueue.remove(dataMessage);
+  _queuedBytes -= size;
+  _server->_queueRemove(size);
+  if(conflated){
+    _queueStats.conflated++;
+  } else {
+    _queueStats.dropped++;
+    _queueStats.droppedBytes += size;
+  }
+  _server->_queueDropped(size, conflated, false);
+}
+
+//makes room for a message according to the queue policy, false when it has to be dropped
+bool AsyncWebSocketClient::_admitMessage(AsyncWebSocketMessage *dataMessage){
+  const AwsQueuePolicy policy = _server->queuePolicy();
+  //with context takeover every queued message is part of the compressed stream, none may go missing
+  const bool removable = (_deflate == NULL || !_deflate->contextTakeover());
+  const size_t size = dataMessage->size();
+  if(policy == WS_QUEUE_CONFLATE && removable && dataMessage->key()){
+    for(const auto& m: _messageQueue){
+      if(m->key() == dataMessage->key() && !m->started()){
+        _dropMessage(m, true);
+        break;
+      }
+    }
+  }
+  if(policy == WS_QUEUE_DROP_OLDEST && removable){
+    while(!_queueFits(size)){
+      //the oldest of the lowest priority, but nothing more important than the new message
+      AsyncWebSocketMessage *oldest = NULL;
+      for(const auto& m: _messageQueue){
+        if(!m->started() && m->priority() >= dataMessage->priority() && (oldest == NULL || m->priority() > oldest->priority()))
+          oldest = m;
+      }
+      if(oldest == NULL)
+        break;
+      _dropMessage(oldest, false);
+    }
+  }
+  return _queueFits(size);
 }
 
 void AsyncWebSocketClient::_queueMessage(AsyncWebSocketMessage *dataMessage){
@@ -626,18 +1593,43 @@ void AsyncWebSocketClient::_queueMessage(AsyncWebSocketMessage *dataMessage){
   }
   if(_status != WS_CONNECTED){
     // Serial.printf("%u Q2\n", _clientId);
+    dataMessage->_released();
     delete dataMessage;
     return;
   }
-  if(_messageQueue.length() >= WS_MAX_QUEUED_MESSAGES){
-      ets_printf(String(F("ERROR: Too many messages queued\n")).c_str());
+  if(!_admitMessage(dataMessage)){
       // Serial.printf("%u Q3\n", _clientId);
+      bool disconnect = (_server->queuePolicy() == WS_QUEUE_DISCONNECT);
+      _queueStats.dropped++;
+      _queueStats.droppedBytes += dataMessage->size();
+      if(disconnect)
+        _queueStats.disconnects++;
+      _server->_queueDropped(dataMessage->size(), false, disconnect);
+      dataMessage->_released();
       delete dataMessage;
+      if(disconnect){
+        close(1008);
+        _status = WS_DISCONNECTING; //drop the connection once the close frame is acked
+        return;
+      }
   } else {
-      _messageQueue.add(dataMessage);
+      if(_deflate != NULL)
+        dataMessage->deflate(_deflate);
+      //ahead of waiting messages of lower priority. Frames of different messages may not interleave,
+      //so one that has started is never overtaken. With context takeover the messages were compressed
+      //in queue order and have to go out in it
+      const AwsMessagePriority priority = dataMessage->priority();
+      if(_deflate != NULL && _deflate->contextTakeover())
+        _messageQueue.add(dataMessage);
+      else
+        _messageQueue.insert(dataMessage, [priority](AsyncWebSocketMessage * const &m){ return !m->started() && m->priority() > priority; });
+      _queuedBytes += dataMessage->size();
+      _server->_queueAdd(dataMessage->size());
+      _drainPending = true;
       // Serial.printf("%u Q A %u\n", _clientId, _messageQueue.length());
   }
-  if(_client->canSend()) {
+  //while frames are on the wire, the next ack sends everything queued until then in one go
+  if(_client->canSend() && !_unackedCount) {
     // Serial.printf("%u Q S\n", _clientId);
     // Serial.println("RUN 3");
     _runQueue();
@@ -655,8 +1647,11 @@ void AsyncWebSocketClient::_queueControl(AsyncWebSocketControl *controlMessage){
 }
 
 void AsyncWebSocketClient::close(uint16_t code, const char * message){
-  if(_status != WS_CONNECTED)
+  if(_status != WS_CONNECTED || _closing)
     return;
+  _closing = true;
+  _closeTime = millis();
+  _armTimer();
   if(code){
     uint8_t packetLen = 2;
     if(message != NULL){
@@ -684,109 +1679,375 @@ void AsyncWebSocketClient::ping(uint8_t *data, size_t len){
     _queueControl(new AsyncWebSocketControl(WS_PING, data, len));
 }
 
+void AsyncWebSocketClient::measureRtt(){
+  uint8_t payload[AWSC_RTT_PAYLOAD_LEN];
+  uint8_t *p = payload + AWSC_PING_PAYLOAD_LEN;
+  const uint32_t seq = ++_pingSeq;
+  const uint32_t sent = micros();
+  memcpy(payload, AWSC_PING_PAYLOAD, AWSC_PING_PAYLOAD_LEN);
+  for(uint8_t i = 0; i < 4; i++){
+    p[i] = (uint8_t)(seq >> (24 - 8 * i));
+    p[4 + i] = (uint8_t)(sent >> (24 - 8 * i));
+  }
+  ping(payload, sizeof(payload));
+}
+
+//true for the pongs of our own pings, which are not reported as WS_EVT_PONG
+bool AsyncWebSocketClient::_onPong(const uint8_t *payload, size_t len){
+  if(len < AWSC_PING_PAYLOAD_LEN || memcmp(AWSC_PING_PAYLOAD, payload, AWSC_PING_PAYLOAD_LEN) != 0)
+    return false;
+  if(len == AWSC_PING_PAYLOAD_LEN)
+    return true;
+  if(len != AWSC_RTT_PAYLOAD_LEN)
+    return false;
+  const uint8_t *p = payload + AWSC_PING_PAYLOAD_LEN;
+  uint32_t seq = 0, sent = 0;
+  for(uint8_t i = 0; i < 4; i++){
+    seq = (seq << 8) | p[i];
+    sent = (sent << 8) | p[4 + i];
+  }
+  //only the latest ping counts, the pong of an older one would give a sample that is too long
+  if(seq != _pingSeq)
+    return true;
+  const uint32_t sample = micros() - sent;
+  if(!_rtt){
+    _rtt = sample;
+    _rttJitter = sample / 2;
+  } else {
+    //RFC 6298 smoothing: gains 1/8 for the mean and 1/4 for the deviation
+    int32_t err = (int32_t)(sample - _rtt);
+    _rtt += err / 8;
+    _rttJitter += ((err < 0 ? -err : err) - (int32_t)_rttJitter) / 4;
+  }
+  _server->_rttSample(sample);
+  return true;
+}
+
 void AsyncWebSocketClient::_onError(int8_t){
 	//Serial.println("onErr");
+  //the pcb is gone with its segments
+  _aborted = true;
 }
 
 void AsyncWebSocketClient::_onTimeout(uint32_t time){
   // Serial.println("onTime");
   (void)time;
-  _client->close(true);
+  _closeNow();
+}
+
+//the socket is going away: drop the connection and leave nothing in the AsyncClient that points to this client
+void AsyncWebSocketClient::_detach(){
+  if(_client == NULL)
+    return;
+  AsyncClient *c = _client;
+  _client = NULL;
+  _status = WS_DISCONNECTED;
+  _aborted = true;
+  c->onError(nullptr, NULL);
+  c->onAck(nullptr, NULL);
+  c->onTimeout(nullptr, NULL);
+  c->onData(nullptr, NULL);
+  c->onPoll(nullptr, NULL);
+  c->onDisconnect([](void *r, AsyncClient* c){ (void)r; delete c; }, NULL);
+  c->abort();
+}
+
+//closes the connection right away. Frames sent without a copy may be unacked, then it is aborted so the stack drops them
+void AsyncWebSocketClient::_closeNow(){
+  if(_inFlight()){
+    _aborted = true;
+    _client->abort();
+  } else {
+    _client->close(true);
+  }
 }
 
 void AsyncWebSocketClient::_onDisconnect(){
   // Serial.println("onDis");
+  //closed by the peer or from outside: the stack keeps retransmitting what is unacked
+  _lingering = !_aborted;
   _client = NULL;
   _server->_handleDisconnect(this);
 }
 
+//collects the 2-14 header bytes, which may arrive split over several segments, and checks the frame
+size_t AsyncWebSocketClient::_parseHeader(const uint8_t *data, size_t len){
+  size_t used = 0;
+  size_t need = 2;
+  while(true){
+    if(_pheadLen >= 2){
+      uint8_t l = _phead[1] & 0x7F;
+      need = 2 + ((l == 126) ? 2 : ((l == 127) ? 8 : 0)) + ((_phead[1] & 0x80) ? 4 : 0);
+    }
+    if(_pheadLen >= need)
+      break;
+    size_t take = std::min(need - _pheadLen, len - used);
+    if(!take)
+      return used;
+    memcpy(_phead + _pheadLen, data + used, take);
+    _pheadLen += take;
+    used += take;
+  }
+  _pheadLen = 0;
+
+  const uint8_t *h = _phead + 2;
+  _pinfo.index = 0;
+  _pinfo.final = (_phead[0] & 0x80) != 0;
+  _pinfo.opcode = _phead[0] & 0x0F;
+  _pinfo.masked = (_phead[1] & 0x80) != 0;
+  _pinfo.len = _phead[1] & 0x7F;
+  if(_pinfo.len == 126){
+    _pinfo.len = (uint16_t)(h[0]) << 8 | h[1];
+    h += 2;
+  } else if(_pinfo.len == 127){
+    _pinfo.len = 0;
+    for(uint8_t i = 0; i < 8; i++)
+      _pinfo.len = (_pinfo.len << 8) | h[i];
+    h += 8;
+  }
+  if(_pinfo.masked)
+    memcpy(_pinfo.mask, h, 4);
+
+  const bool rsv1 = (_phead[0] & 0x40) != 0;
+  bool valid = !(_phead[0] & 0x30)             //RSV2 and RSV3 belong to no extension we know
+    && (!rsv1 || (_deflate != NULL && (_pinfo.opcode == WS_TEXT || _pinfo.opcode == WS_BINARY))) //RSV1 only marks the first frame of a compressed message
+    && (_pinfo.opcode & 0x07) <= WS_BINARY      //3-7 and 0xB-0xF are reserved
+    && !(_pinfo.len >> 63)                      //most significant bit must be 0
+    && (!(_pinfo.opcode & 0x08) || (_pinfo.final && _pinfo.len <= 125));
+  if(!valid){
+    _failConnection(1002);
+    return used;
+  }
+  if(_pinfo.opcode && !(_pinfo.opcode & 0x08)){
+    _pinfo.message_opcode = _pinfo.opcode;
+    _pinfo.num = 0;
+    _pcompressed = rsv1;
+    //compressed text is checked once inflated
+    _putf8 = _pinfo.opcode == WS_TEXT && !rsv1 && _server->utf8Validation();
+    memset(&_utf8, 0, sizeof(_utf8));
+  }
+  _pstate = 1;
+  return used;
+}
+
+//collects a compressed message, the application gets it inflated as one final frame
+bool AsyncWebSocketClient::_inflateData(uint8_t *data, size_t len, bool last){
+  AwsInflateResult result = WS_INFLATE_OK;
+  uint8_t *out = NULL;
+  size_t outLen = 0;
+  if(!_deflate->append(data, len))
+    result = WS_INFLATE_TOO_LARGE;
+  else if(last)
+    result = _deflate->inflate(&out, &outLen);
+  if(result != WS_INFLATE_OK){
+    _deflate->reset();
+    _failConnection((result == WS_INFLATE_TOO_LARGE) ? 1009 : 1007);
+    return false;
+  }
+  if(!last)
+    return true;
+  if(_pinfo.message_opcode == WS_TEXT && _server->utf8Validation()){
+    AwsUtf8State utf8 = {0, 0, 0};
+    if(!webSocketValidUtf8(&utf8, out, outLen) || utf8.need){
+      free(out);
+      _failConnection(1007);
+      return false;
+    }
+  }
+  _deliverMessage(_pinfo.message_opcode, out, outLen);
+  free(out);
+  return _pstate != 2;
+}
+
+//a whole message, to the onMessage() handler or as one final WS_EVT_DATA frame
+void AsyncWebSocketClient::_deliverMessage(uint8_t opcode, uint8_t *data, size_t len){
+  if(_server->_assembling()){
+    if(len > _server->maxMessageSize()){
+      _failConnection(1009);
+      return;
+    }
+    _server->_handleMessage(this, (AwsFrameType)opcode, data, len);
+    return;
+  }
+  AwsFrameInfo info = _pinfo;
+  info.opcode = opcode;
+  info.num = 0;
+  info.final = 1;
+  info.index = 0;
+  info.len = len;
+  _server->_handleEvent(this, WS_EVT_DATA, (void *)&info, data, len);
+}
+
+//collects the frames of a message for the onMessage() handler
+bool AsyncWebSocketClient::_assembleData(uint8_t *data, size_t len, bool last){
+  //a message that arrived in one piece is handed over from the TCP buffer
+  if(_assembly == NULL && last && _pinfo.num == 0 && _pinfo.index == 0){
+    _deliverMessage(_pinfo.message_opcode, data, len);
+    return _pstate != 2;
+  }
+  const size_t maxSize = _server->maxMessageSize();
+  const size_t need = _assemblyLen + len;
+  if(need > maxSize){
+    _failConnection(1009);
+    return false;
+  }
+  if(_assembly == NULL || need > _assembly->capacity()){
+    //room for the rest of this frame, and twice as much once it spans several frames
+    size_t size = _assemblyLen + (size_t)(_pinfo.len - _pinfo.index);
+    if(_assembly != NULL && size < 2 * _assembly->capacity())
+      size = 2 * _assembly->capacity();
+    if(size > maxSize)
+      size = maxSize;
+    AsyncWebSocketMessageBuffer *buffer = _server->makeBuffer(size);
+    if(buffer == NULL){
+      _failConnection(1009);
+      return false;
+    }
+    //kept from cleanupClients() while the message is collected
+    buffer->lock();
+    if(_assembly != NULL){
+      memcpy(buffer->get(), _assembly->get(), _assemblyLen);
+      _server->_releaseBuffer(_assembly);
+    }
+    _assembly = buffer;
+  }
+  memcpy(_assembly->get() + _assemblyLen, data, len);
+  _assemblyLen += len;
+  if(!last)
+    return true;
+  AsyncWebSocketMessageBuffer *buffer = _assembly;
+  size_t total = _assemblyLen;
+  _assembly = NULL;
+  _assemblyLen = 0;
+  buffer->get()[total] = 0;
+  _deliverMessage(_pinfo.message_opcode, buffer->get(), total);
+  _server->_releaseBuffer(buffer);
+  return _pstate != 2;
+}
+
+//closes with an error code and ignores whatever the peer sends until then
+void AsyncWebSocketClient::_failConnection(uint16_t code){
+  _pstate = 2;
+  if(_assembly != NULL){
+    _server->_releaseBuffer(_assembly);
+    _assembly = NULL;
+    _assemblyLen = 0;
+  }
+  close(code);
+  _status = WS_DISCONNECTING; //drop the connection once the close frame is acked
+}
+
 void AsyncWebSocketClient::_onData(void *pbuf, size_t plen){
   // Serial.println("onData");
   _lastMessageTime = millis();
   uint8_t *data = (uint8_t*)pbuf;
-  while(plen > 0){
-    if(!_pstate){
-      const uint8_t *fdata = data;
-      _pinfo.index = 0;
-      _pinfo.final = (fdata[0] & 0x80) != 0;
-      _pinfo.opcode = fdata[0] & 0x0F;
-      _pinfo.masked = (fdata[1] & 0x80) != 0;
-      _pinfo.len = fdata[1] & 0x7F;
-      data += 2;
-      plen -= 2;
-      if(_pinfo.len == 126){
-        _pinfo.len = fdata[3] | (uint16_t)(fdata[2]) << 8;
-        data += 2;
-        plen -= 2;
-      } else if(_pinfo.len == 127){
-        _pinfo.len = fdata[9] | (uint16_t)(fdata[8]) << 8 | (uint32_t)(fdata[7]) << 16 | (uint32_t)(fdata[6]) << 24 | (uint64_t)(fdata[5]) << 32 | (uint64_t)(fdata[4]) << 40 | (uint64_t)(fdata[3]) << 48 | (uint64_t)(fdata[2]) << 56;
-        data += 8;
-        plen -= 8;
-      }
-
-      if(_pinfo.masked){
-        memcpy(_pinfo.mask, data, 4);
-        data += 4;
-        plen -= 4;
-      }
+  while(true){
+    //_pstate: 0 = frame header, 1 = payload, 2 = protocol error, the rest is dropped
+    if(_pstate == 0){
+      if(!plen)
+        return;
+      size_t used = _parseHeader(data, plen);
+      data += used;
+      plen -= used;
+      if(_pstate != 1)
+        return;
+    } else if(_pstate != 1 || !plen){
+      return;
     }
 
-    const size_t datalen = std::min((size_t)(_pinfo.len - _pinfo.index), plen);
-    const auto datalast = data[datalen];
+    const uint64_t left = _pinfo.len - _pinfo.index;
+    const size_t datalen = (left < plen) ? (size_t)left : plen;
+    // _handleEvent may add a null terminator i.e., data[len] = 0; keep the byte when it belongs to the next frame
+    const bool restore = datalen > 0 && datalen < plen;
+    const uint8_t datalast = restore ? data[datalen] : 0;
+    const bool control = (_pinfo.opcode & 0x08) != 0;
 
     if(_pinfo.masked){
-      for(size_t i=0;i<datalen;i++)
-        data[i] ^= _pinfo.mask[(_pinfo.index+i)%4];
+      webSocketMask(data, datalen, _pinfo.mask, _pinfo.index);
     }
 
-    if((datalen + _pinfo.index) < _pinfo.len){
-      _pstate = 1;
+    //a text message that ends inside a character is as invalid as a wrong byte
+    if(_putf8 && !control && (!webSocketValidUtf8(&_utf8, data, datalen)
+        || (_utf8.need && _pinfo.final && datalen + _pinfo.index >= _pinfo.len))){
+      _failConnection(1007);
+      return;
+    }
 
-      if(_pinfo.index == 0){
-        if(_pinfo.opcode){
-          _pinfo.message_opcode = _pinfo.opcode;
-          _pinfo.num = 0;
-        }
-      }
-      if (datalen > 0) _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, (uint8_t*)data, datalen);
+    if((datalen + _pinfo.index) < _pinfo.len){
+      if(control){
+        //control payloads are handled whole, keep the part we have
+        if(datalen && _pcontrol == NULL)
+          _pcontrol = (uint8_t*)malloc(125);
+        if(_pcontrol == NULL){
+          if(datalen){
+            _pstate = 2;
+            _closeNow();
+            return;
+          }
+        } else memcpy(_pcontrol + _pinfo.index, data, datalen);
+      } else if(_pcompressed){
+        if(!_inflateData(data, datalen, false))
+          return;
+      } else if(_server->_assembling()){
+        if(!_assembleData(data, datalen, false))
+          return;
+      } else if (datalen > 0) _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, (uint8_t*)data, datalen);
 
       _pinfo.index += datalen;
-    } else if((datalen + _pinfo.index) == _pinfo.len){
+    } else {
       _pstate = 0;
+      uint8_t *payload = data;
+      size_t payloadLen = datalen;
+      if(control && _pinfo.index){
+        memcpy(_pcontrol + _pinfo.index, data, datalen);
+        payload = _pcontrol;
+        payloadLen += _pinfo.index;
+      }
       if(_pinfo.opcode == WS_DISCONNECT){
-        if(datalen){
-          uint16_t reasonCode = (uint16_t)(data[0] << 8) + data[1];
-          char * reasonString = (char*)(data+2);
+        if(payloadLen >= 2){
+          uint16_t reasonCode = (uint16_t)(payload[0] << 8) + payload[1];
           if(reasonCode > 1001){
-            _server->_handleEvent(this, WS_EVT_ERROR, (void *)&reasonCode, (uint8_t*)reasonString, strlen(reasonString));
+            char reasonString[124];
+            memcpy(reasonString, payload + 2, payloadLen - 2);
+            reasonString[payloadLen - 2] = 0;
+            _server->_handleEvent(this, WS_EVT_ERROR, (void *)&reasonCode, (uint8_t*)reasonString, payloadLen - 2);
           }
         }
         if(_status == WS_DISCONNECTING){
           _status = WS_DISCONNECTED;
-          _client->close(true);
+          _closeNow();
+          return;
         } else {
           _status = WS_DISCONNECTING;
           _client->ackLater();
-          _queueControl(new AsyncWebSocketControl(WS_DISCONNECT, data, datalen));
+          _queueControl(new AsyncWebSocketControl(WS_DISCONNECT, payload, payloadLen));
         }
       } else if(_pinfo.opcode == WS_PING){
-        _queueControl(new AsyncWebSocketControl(WS_PONG, data, datalen));
+        _queueControl(new AsyncWebSocketControl(WS_PONG, payload, payloadLen));
       } else if(_pinfo.opcode == WS_PONG){
-        if(datalen != AWSC_PING_PAYLOAD_LEN || memcmp(AWSC_PING_PAYLOAD, data, AWSC_PING_PAYLOAD_LEN) != 0)
-          _server->_handleEvent(this, WS_EVT_PONG, NULL, data, datalen);
-      } else if(_pinfo.opcode < 8){//continuation or text/binary frame
+        if(_pongPending){
+          _pongPending = false;
+          _armTimer();
+        }
+        if(!_onPong(payload, payloadLen))
+          _server->_handleEvent(this, WS_EVT_PONG, NULL, payload, payloadLen);
+      } else if(_pcompressed || _server->_assembling()){
+        if(!(_pcompressed ? _inflateData(data, datalen, _pinfo.final) : _assembleData(data, datalen, _pinfo.final)))
+          return;
+        if (_pinfo.final) _pinfo.num = 0;
+        else _pinfo.num += 1;
+      } else {//continuation or text/binary frame
         _server->_handleEvent(this, WS_EVT_DATA, (void *)&_pinfo, data, datalen);
         if (_pinfo.final) _pinfo.num = 0;
-        else _pinfo.num += 1;   
+        else _pinfo.num += 1;
+      }
+      if(_pcontrol != NULL){
+        free(_pcontrol);
+        _pcontrol = NULL;
       }
-    } else {
-      //os_printf("frame error: len: %u, index: %llu, total: %llu\n", datalen, _pinfo.index, _pinfo.len);
-      //what should we do?
-      break;
     }
 
-    // restore byte as _handleEvent may have added a null terminator i.e., data[len] = 0;
-    if (datalen > 0)
+    if (restore)
       data[datalen] = datalast;
 
     data += datalen;
@@ -909,6 +2170,18 @@ void AsyncWebSocketClient::binary(AsyncWebSocketMessageBuffer * buffer)
   _queueMessage(new AsyncWebSocketMultiMessage(buffer, WS_BINARY));
 }
 
+bool AsyncWebSocketClient::subscribe(uint32_t topic){
+  return _server->subscribe(_clientId, topic);
+}
+
+void AsyncWebSocketClient::unsubscribe(uint32_t topic){
+  _server->unsubscribe(_clientId, topic);
+}
+
+bool AsyncWebSocketClient::subscribed(uint32_t topic){
+  return _server->subscribed(_clientId, topic);
+}
+
 IPAddress AsyncWebSocketClient::remoteIP() {
     if(!_client) {
         return IPAddress(0U);
@@ -932,14 +2205,81 @@ uint16_t AsyncWebSocketClient::remotePort() {
 AsyncWebSocket::AsyncWebSocket(const String& url)
   :_url(url)
   ,_clients(LinkedList<AsyncWebSocketClient *>([](AsyncWebSocketClient *c){ delete c; }))
+  ,_clientIndex(NULL)
+  ,_clientIndexBits(0)
+  ,_clientIndexCount(0)
   ,_cNextId(1)
+  ,_topics(LinkedList<AsyncWebSocketTopic *>([](AsyncWebSocketTopic *t){ delete t; }))
+  ,_topicIndex(NULL)
+  ,_topicIndexBits(0)
+  ,_topicIndexCount(0)
+  ,_retired(LinkedList<AsyncWebSocketRetiredMessage *>([](AsyncWebSocketRetiredMessage *r){ delete r; }))
   ,_enabled(true)
-  ,_buffers(LinkedList<AsyncWebSocketMessageBuffer *>([](AsyncWebSocketMessageBuffer *b){ delete b; }))
+  ,_deflateEnabled(false)
+  ,_utf8Validation(WS_VALIDATE_UTF8)
+  ,_deflateWindowBits(WS_DEFLATE_WINDOW_BITS)
+  ,_deflateContextTakeover(false)
+  ,_deflateMaxSize(WS_DEFLATE_MAX_MESSAGE_SIZE)
+  ,_deflateMinSize(WS_DEFLATE_MIN_SIZE)
+  ,_maxClientQueuedBytes(WS_MAX_QUEUED_BYTES)
+  ,_maxQueuedBytes(WS_MAX_QUEUED_BYTES_TOTAL)
+  ,_queuedBytes(0)
+  ,_queuePolicy(WS_QUEUE_DROP_NEWEST)
+  ,_keepAlive(0)
+  ,_pongTimeout(WS_PONG_TIMEOUT)
+  ,_idleTimeout(0)
+  ,_maxClients(0)
+  ,_clientLimitPolicy(WS_LIMIT_REJECT)
 {
   _eventHandler = NULL;
+  _messageHandler = NULL;
+  _maxMessageSize = WS_MAX_MESSAGE_SIZE;
+  memset(&_queueStats, 0, sizeof(_queueStats));
+  memset(&_rttHistogram, 0, sizeof(_rttHistogram));
+}
+
+AsyncWebSocket::~AsyncWebSocket(){
+  //the connections stay open after the clients are gone, so they are dropped first and keep no callback into them
+  for(const auto& c: _clients)
+    c->_detach();
+  //clients call back into the socket while they are deleted, so they go before any member
+  _clients.free();
+  _topics.free();
+  free(_topicIndex);
+  _retired.free();
+  free(_clientIndex);
+}
+
+void AsyncWebSocket::setDeflate(bool enable, uint8_t windowBits, bool contextTakeover){
+  _deflateEnabled = enable;
+  _deflateWindowBits = (windowBits < 8) ? 8 : ((windowBits > 15) ? 15 : windowBits);
+  _deflateContextTakeover = contextTakeover;
+}
+
+void AsyncWebSocket::setDeflateLimits(size_t maxMessageSize, size_t minSize){
+  _deflateMaxSize = maxMessageSize;
+  _deflateMinSize = minSize;
+}
+
+void AsyncWebSocket::setQueueLimits(size_t clientBytes, size_t totalBytes){
+  _maxClientQueuedBytes = clientBytes;
+  _maxQueuedBytes = totalBytes;
 }
 
-AsyncWebSocket::~AsyncWebSocket(){}
+bool AsyncWebSocket::_queueFits(size_t clientQueued, size_t size) const {
+  return clientQueued + size <= _maxClientQueuedBytes && _queuedBytes + size <= _maxQueuedBytes;
+}
+
+void AsyncWebSocket::_queueDropped(size_t size, bool conflated, bool disconnect){
+  if(conflated){
+    _queueStats.conflated++;
+  } else {
+    _queueStats.dropped++;
+    _queueStats.droppedBytes += size;
+  }
+  if(disconnect)
+    _queueStats.disconnects++;
+}
 
 void AsyncWebSocket::_handleEvent(AsyncWebSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len){
   if(_eventHandler != NULL){
@@ -947,15 +2287,115 @@ void AsyncWebSocket::_handleEvent(AsyncWebSocketClient * client, AwsEventType ty
   }
 }
 
+uint32_t AsyncWebSocket::_getNextId(){
+  //ids repeat only after 2^32 clients, and then skip the ones still in use
+  uint32_t id;
+  do {
+    id = _cNextId++;
+  } while(id == 0 || _findClient(id) != NULL);
+  return id;
+}
+
+AsyncWebSocketClient * AsyncWebSocket::_findClient(uint32_t id) const {
+  if(_clientIndex == NULL)
+    return NULL;
+  const size_t mask = ((size_t)1 << _clientIndexBits) - 1;
+  for(size_t i = _indexSlot(id); _clientIndex[i] != NULL; i = (i + 1) & mask){
+    if(_clientIndex[i]->id() == id)
+      return _clientIndex[i];
+  }
+  return NULL;
+}
+
+//makes room in the index for one more client, checked before a handshake is answered
+bool AsyncWebSocket::_reserveClient(){
+  //keep the table at most half full
+  if(_clientIndex == NULL || (size_t)(_clientIndexCount + 1) * 2 > ((size_t)1 << _clientIndexBits)){
+    uint8_t bits = _clientIndex ? _clientIndexBits + 1 : 3;
+    AsyncWebSocketClient ** index = (AsyncWebSocketClient **)calloc((size_t)1 << bits, sizeof(AsyncWebSocketClient *));
+    if(index == NULL)
+      return false;
+    AsyncWebSocketClient ** old = _clientIndex;
+    size_t oldSize = old ? ((size_t)1 << _clientIndexBits) : 0;
+    _clientIndex = index;
+    _clientIndexBits = bits;
+    const size_t mask = ((size_t)1 << bits) - 1;
+    for(size_t j = 0; j < oldSize; j++){
+      if(old[j] == NULL)
+        continue;
+      size_t i = _indexSlot(old[j]->id());
+      while(_clientIndex[i] != NULL)
+        i = (i + 1) & mask;
+      _clientIndex[i] = old[j];
+    }
+    free(old);
+  }
+  return true;
+}
+
+bool AsyncWebSocket::_indexClient(AsyncWebSocketClient * client){
+  if(!_reserveClient())
+    return false;
+  const size_t mask = ((size_t)1 << _clientIndexBits) - 1;
+  size_t i = _indexSlot(client->id());
+  while(_clientIndex[i] != NULL)
+    i = (i + 1) & mask;
+  _clientIndex[i] = client;
+  _clientIndexCount++;
+  return true;
+}
+
+void AsyncWebSocket::_unindexClient(uint32_t id){
+  if(_clientIndex == NULL)
+    return;
+  const size_t mask = ((size_t)1 << _clientIndexBits) - 1;
+  size_t i = _indexSlot(id);
+  while(_clientIndex[i] != NULL && _clientIndex[i]->id() != id)
+    i = (i + 1) & mask;
+  if(_clientIndex[i] == NULL)
+    return;
+  _clientIndex[i] = NULL;
+  _clientIndexCount--;
+  //move later entries of the probe run back into the gap, no tombstones needed
+  for(size_t j = (i + 1) & mask; _clientIndex[j] != NULL; j = (j + 1) & mask){
+    size_t home = _indexSlot(_clientIndex[j]->id());
+    if(((j - home) & mask) >= ((j - i) & mask)){
+      _clientIndex[i] = _clientIndex[j];
+      _clientIndex[j] = NULL;
+      i = j;
+    }
+  }
+}
+
+void AsyncWebSocket::_handleMessage(AsyncWebSocketClient * client, AwsFrameType type, uint8_t *data, size_t len){
+  if(_messageHandler != NULL){
+    _messageHandler(this, client, type, data, len);
+  }
+}
+
 void AsyncWebSocket::_addClient(AsyncWebSocketClient * client){
   _clients.add(client);
+  //handleRequest() reserved the slot, so this does not fail
+  _indexClient(client);
 }
 
 void AsyncWebSocket::_handleDisconnect(AsyncWebSocketClient * client){
-
-  _clients.remove_first([=](AsyncWebSocketClient * c){
-    return c->id() == client->id();
-  });
+  _unindexClient(client->id());
+  for(const auto& t: _topics)
+    t->subscribers.remove(client);
+  while(true){
+    AsyncWebSocketTopic * empty = NULL;
+    for(const auto& t: _topics){
+      if(t->subscribers.isEmpty()){
+        empty = t;
+        break;
+      }
+    }
+    if(empty == NULL)
+      break;
+    _dropTopic(empty);
+  }
+  _clients.remove(client);
 }
 
 bool AsyncWebSocket::availableForWriteAll(){
@@ -966,10 +2406,8 @@ bool AsyncWebSocket::availableForWriteAll(){
 }
 
 bool AsyncWebSocket::availableForWrite(uint32_t id){
-  for(const auto& c: _clients){
-    if(c->queueIsFull() && (c->id() == id )) return false;
-  }
-  return true;
+  AsyncWebSocketClient * c = _findClient(id);
+  return c == NULL || !c->queueIsFull();
 }
 
 size_t AsyncWebSocket::count() const {
@@ -979,12 +2417,8 @@ size_t AsyncWebSocket::count() const {
 }
 
 AsyncWebSocketClient * AsyncWebSocket::client(uint32_t id){
-  for(const auto &c: _clients){
-    if(c->id() == id && c->status() == WS_CONNECTED){
-      return c;
-    }
-  }
-  return nullptr;
+  AsyncWebSocketClient * c = _findClient(id);
+  return (c != nullptr && c->status() == WS_CONNECTED) ? c : nullptr;
 }
 
 
@@ -1001,11 +2435,90 @@ void AsyncWebSocket::closeAll(uint16_t code, const char * message){
   }
 }
 
+void AsyncWebSocket::setKeepAlive(uint16_t interval, uint16_t pongTimeout){
+  _keepAlive = interval;
+  _pongTimeout = pongTimeout;
+}
+
+void AsyncWebSocket::resetRttHistogram(){
+  memset(&_rttHistogram, 0, sizeof(_rttHistogram));
+}
+
+void AsyncWebSocket::_rttSample(uint32_t us){
+  uint32_t ms = us / 1000;
+  uint8_t bucket = 0;
+  while(ms && bucket < WS_RTT_BUCKETS - 1){
+    ms >>= 1;
+    bucket++;
+  }
+  _rttHistogram.buckets[bucket]++;
+  _rttHistogram.samples++;
+  if(us > _rttHistogram.max)
+    _rttHistogram.max = us;
+}
+
+void AsyncWebSocket::setIdleTimeout(uint16_t seconds){
+  _idleTimeout = seconds;
+  for(const auto& c: _clients)
+    c->_armTimer();
+}
+
 void AsyncWebSocket::cleanupClients(uint16_t maxClients)
 {
   if (count() > maxClients){
     _clients.front()->close();
   }
+  _reapRetired();
+  _bufferPool.reclaim();
+}
+
+void AsyncWebSocket::_retire(AsyncWebSocketMessage * message){
+  AsyncWebSocketRetiredMessage * r = new AsyncWebSocketRetiredMessage(message, millis());
+  if(r == NULL){
+    message->_released();
+    delete message;
+    return;
+  }
+  const size_t retired = _retired.length();
+  _retired.add(r);
+  //without a list node it can not be kept either
+  if(_retired.length() == retired)
+    delete r;
+}
+
+void AsyncWebSocket::_reapRetired(){
+  const uint32_t now = millis();
+  while(!_retired.isEmpty() && (now - _retired.front()->since) >= WS_ZERO_COPY_LINGER)
+    _retired.remove(_retired.front());
+}
+
+void AsyncWebSocket::setMaxClients(uint16_t maxClients, AwsClientLimitPolicy policy){
+  _maxClients = maxClients;
+  _clientLimitPolicy = policy;
+}
+
+//drops a client to make room for a new one, false when the policy finds none
+bool AsyncWebSocket::_evictClient(){
+  if(_clientLimitPolicy == WS_LIMIT_REJECT)
+    return false;
+  const bool byPriority = (_clientLimitPolicy == WS_LIMIT_EVICT_LOWEST_PRIORITY);
+  const uint32_t now = millis();
+  AsyncWebSocketClient * victim = NULL;
+  for(const auto& c: _clients){
+    if(c->status() != WS_CONNECTED || c->client() == NULL)
+      continue;
+    //new clients start at normal priority and do not push out one that is as important
+    if(byPriority && c->priority() <= WS_PRIORITY_NORMAL)
+      continue;
+    if(victim == NULL || (byPriority && c->priority() > victim->priority())
+        || ((!byPriority || c->priority() == victim->priority()) && (now - c->lastActivity()) > (now - victim->lastActivity())))
+      victim = c;
+  }
+  if(victim == NULL)
+    return false;
+  //a close handshake would keep its memory until the peer answers
+  victim->_closeNow();
+  return true;
 }
 
 void AsyncWebSocket::ping(uint32_t id, uint8_t *data, size_t len){
@@ -1036,7 +2549,6 @@ void AsyncWebSocket::textAll(AsyncWebSocketMessageBuffer * buffer){
     }
   }
   buffer->unlock();
-  _cleanBuffers();
 }
 
 
@@ -1066,7 +2578,6 @@ void AsyncWebSocket::binaryAll(AsyncWebSocketMessageBuffer * buffer)
       c->binary(buffer);
   }
   buffer->unlock();
-  _cleanBuffers();
 }
 
 void AsyncWebSocket::message(uint32_t id, AsyncWebSocketMessage *message){
@@ -1080,7 +2591,135 @@ void AsyncWebSocket::messageAll(AsyncWebSocketMultiMessage *message){
     if(c->status() == WS_CONNECTED)
       c->message(message);
   }
-  _cleanBuffers();
+}
+
+AsyncWebSocketTopic * AsyncWebSocket::_findTopic(uint32_t topic) const {
+  if(_topicIndex == NULL)
+    return NULL;
+  const size_t mask = ((size_t)1 << _topicIndexBits) - 1;
+  for(size_t i = _topicSlot(topic); _topicIndex[i] != NULL; i = (i + 1) & mask){
+    if(_topicIndex[i]->id == topic)
+      return _topicIndex[i];
+  }
+  return NULL;
+}
+
+bool AsyncWebSocket::_indexTopic(AsyncWebSocketTopic * t){
+  //keep the table at most half full
+  if(_topicIndex == NULL || (size_t)(_topicIndexCount + 1) * 2 > ((size_t)1 << _topicIndexBits)){
+    uint8_t bits = _topicIndex ? _topicIndexBits + 1 : 3;
+    AsyncWebSocketTopic ** index = (AsyncWebSocketTopic **)calloc((size_t)1 << bits, sizeof(AsyncWebSocketTopic *));
+    if(index == NULL)
+      return false;
+    AsyncWebSocketTopic ** old = _topicIndex;
+    size_t oldSize = old ? ((size_t)1 << _topicIndexBits) : 0;
+    _topicIndex = index;
+    _topicIndexBits = bits;
+    const size_t mask = ((size_t)1 << bits) - 1;
+    for(size_t j = 0; j < oldSize; j++){
+      if(old[j] == NULL)
+        continue;
+      size_t i = _topicSlot(old[j]->id);
+      while(_topicIndex[i] != NULL)
+        i = (i + 1) & mask;
+      _topicIndex[i] = old[j];
+    }
+    free(old);
+  }
+  const size_t mask = ((size_t)1 << _topicIndexBits) - 1;
+  size_t i = _topicSlot(t->id);
+  while(_topicIndex[i] != NULL)
+    i = (i + 1) & mask;
+  _topicIndex[i] = t;
+  _topicIndexCount++;
+  return true;
+}
+
+//takes the topic out of the index and the list, which deletes it
+void AsyncWebSocket::_dropTopic(AsyncWebSocketTopic * t){
+  if(_topicIndex != NULL){
+    const size_t mask = ((size_t)1 << _topicIndexBits) - 1;
+    size_t i = _topicSlot(t->id);
+    while(_topicIndex[i] != NULL && _topicIndex[i] != t)
+      i = (i + 1) & mask;
+    if(_topicIndex[i] != NULL){
+      _topicIndex[i] = NULL;
+      _topicIndexCount--;
+      //move later entries of the probe run back into the gap, as for the client index
+      for(size_t j = (i + 1) & mask; _topicIndex[j] != NULL; j = (j + 1) & mask){
+        size_t home = _topicSlot(_topicIndex[j]->id);
+        if(((j - home) & mask) >= ((j - i) & mask)){
+          _topicIndex[i] = _topicIndex[j];
+          _topicIndex[j] = NULL;
+          i = j;
+        }
+      }
+    }
+  }
+  _topics.remove(t);
+}
+
+bool AsyncWebSocket::subscribe(uint32_t id, uint32_t topic){
+  AsyncWebSocketClient * c = client(id);
+  if(c == NULL)
+    return false;
+  AsyncWebSocketTopic * t = _findTopic(topic);
+  if(t == NULL){
+    t = new AsyncWebSocketTopic(topic);
+    if(t == NULL)
+      return false;
+    if(!_indexTopic(t)){
+      delete t;
+      return false;
+    }
+    _topics.add(t);
+  } else if(t->subscribers.count_if([c](AsyncWebSocketClient * s){ return s == c; })){
+    return true;
+  }
+  t->subscribers.add(c);
+  return true;
+}
+
+void AsyncWebSocket::unsubscribe(uint32_t id, uint32_t topic){
+  AsyncWebSocketTopic * t = _findTopic(topic);
+  if(t == NULL)
+    return;
+  t->subscribers.remove_first([id](AsyncWebSocketClient * s){ return s->id() == id; });
+  if(t->subscribers.isEmpty())
+    _dropTopic(t);
+}
+
+bool AsyncWebSocket::subscribed(uint32_t id, uint32_t topic) const {
+  AsyncWebSocketTopic * t = _findTopic(topic);
+  return t != NULL && t->subscribers.count_if([id](AsyncWebSocketClient * s){ return s->id() == id; }) > 0;
+}
+
+size_t AsyncWebSocket::subscribers(uint32_t topic) const {
+  AsyncWebSocketTopic * t = _findTopic(topic);
+  return t ? t->subscribers.length() : 0;
+}
+
+void AsyncWebSocket::publish(uint32_t topic, AsyncWebSocketMessageBuffer * buffer, AwsFrameType type){
+  if (!buffer) return;
+  AsyncWebSocketTopic * t = _findTopic(topic);
+  buffer->lock();
+  if(t != NULL){
+    for(const auto& c: t->subscribers){
+      if(c->status() == WS_CONNECTED)
+        c->message(new AsyncWebSocketMultiMessage(buffer, type));
+    }
+  }
+  buffer->unlock();
+}
+
+void AsyncWebSocket::publish(uint32_t topic, const char * message, size_t len, AwsFrameType type){
+  if(!subscribers(topic))
+    return;
+  publish(topic, makeBuffer((uint8_t *)message, len), type);
+}
+
+void AsyncWebSocket::publish(uint32_t topic, const String &message, AwsFrameType type){
+  publish(topic, message.c_str(), message.length(), type);
 }
 
 size_t AsyncWebSocket::printf(uint32_t id, const char *format, ...){
@@ -1235,7 +2874,7 @@ const char __WS_STR_COOKIE[] PROGMEM = { "Cookie" };
 const char __WS_STR_VERSION[] PROGMEM = { "Sec-WebSocket-Version" };
 const char __WS_STR_KEY[] PROGMEM = { "Sec-WebSocket-Key" };
 const char __WS_STR_PROTOCOL[] PROGMEM = { "Sec-WebSocket-Protocol" };
-const char __WS_STR_ACCEPT[] PROGMEM = { "Sec-WebSocket-Accept" };
+const char __WS_STR_EXTENSIONS[] PROGMEM = { "Sec-WebSocket-Extensions" };
 const char __WS_STR_UUID[] PROGMEM = { "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" };
 
 #define WS_STR_CONNECTION FPSTR(__WS_STR_CONNECTION)
@@ -1245,7 +2884,7 @@ const char __WS_STR_UUID[] PROGMEM = { "258EAFA5-E914-47DA-95CA-C5AB0DC85B11" };
 #define WS_STR_VERSION FPSTR(__WS_STR_VERSION)
 #define WS_STR_KEY FPSTR(__WS_STR_KEY)
 #define WS_STR_PROTOCOL FPSTR(__WS_STR_PROTOCOL)
-#define WS_STR_ACCEPT FPSTR(__WS_STR_ACCEPT)
+#define WS_STR_EXTENSIONS FPSTR(__WS_STR_EXTENSIONS)
 #define WS_STR_UUID FPSTR(__WS_STR_UUID)
 
 bool AsyncWebSocket::canHandle(AsyncWebServerRequest *request){
@@ -1262,6 +2901,8 @@ bool AsyncWebSocket::canHandle(AsyncWebServerRequest *request){
   request->addInterestingHeader(WS_STR_VERSION);
   request->addInterestingHeader(WS_STR_KEY);
   request->addInterestingHeader(WS_STR_PROTOCOL);
+  if(_deflateEnabled)
+    request->addInterestingHeader(WS_STR_EXTENSIONS);
   return true;
 }
 
@@ -1289,49 +2930,50 @@ void AsyncWebSocket::handleRequest(AsyncWebServerRequest *request){
     return;
   }
   AsyncWebHeader* key = request->getHeader(WS_STR_KEY);
-  AsyncWebServerResponse *response = new AsyncWebSocketResponse(key->value(), this);
-  if(request->hasHeader(WS_STR_PROTOCOL)){
-    AsyncWebHeader* protocol = request->getHeader(WS_STR_PROTOCOL);
-    //ToDo: check protocol
-    response->addHeader(WS_STR_PROTOCOL, protocol->value());
+  AsyncWebSocketDeflate *deflate = NULL;
+  String extensions;
+  if(_deflateEnabled && request->hasHeader(WS_STR_EXTENSIONS)){
+    uint8_t windowBits = _deflateWindowBits;
+    bool contextTakeover = false;
+    if(AsyncWebSocketDeflate::negotiate(request->getHeader(WS_STR_EXTENSIONS)->value(), _deflateWindowBits, _deflateContextTakeover, extensions, &windowBits, &contextTakeover))
+      deflate = new AsyncWebSocketDeflate(windowBits, contextTakeover, _deflateMinSize, _deflateMaxSize);
+  }
+  //the response takes Sec-WebSocket-Protocol from the request itself. ToDo: check protocol
+  AsyncWebServerResponse *response = new AsyncWebSocketResponse(key->value(), this, deflate, extensions);
+  if(response->_failed()){
+    delete response;
+    request->send(400);
+    return;
+  }
+  //only a valid handshake may push out a connected client
+  if(_maxClients && _clients.length() >= _maxClients && !_evictClient()){
+    delete response;
+    request->send(503);
+    return;
+  }
+  //a client that client(id) could not find is not taken on
+  if(!_reserveClient()){
+    delete response;
+    request->send(503);
+    return;
   }
   request->send(response);
 }
 
 AsyncWebSocketMessageBuffer * AsyncWebSocket::makeBuffer(size_t size)
 {
-  AsyncWebSocketMessageBuffer * buffer = new AsyncWebSocketMessageBuffer(size);
-  if (buffer) {
-    AsyncWebLockGuard l(_lock);
-    _buffers.add(buffer);
-  }
-  return buffer;
+  return _bufferPool.acquire(size);
 }
 
 AsyncWebSocketMessageBuffer * AsyncWebSocket::makeBuffer(uint8_t * data, size_t size)
 {
-  AsyncWebSocketMessageBuffer * buffer = new AsyncWebSocketMessageBuffer(data, size);
-
-  if (buffer) {
-    AsyncWebLockGuard l(_lock);
-    // Serial.printf("Add to global buffers = %u\n", _buffers.length() + 1);
-    _buffers.add(buffer);
+  AsyncWebSocketMessageBuffer * buffer = _bufferPool.acquire(size);
+  if (buffer && data) {
+    memcpy(buffer->get(), data, size);
   }
-
   return buffer;
 }
 
-void AsyncWebSocket::_cleanBuffers()
-{
-  AsyncWebLockGuard l(_lock);
-  for(AsyncWebSocketMessageBuffer * c: _buffers){
-    if(c && c->canDelete()){
-        // Serial.printf("Remove from global buffers = %u\n", _buffers.length() - 1);
-        _buffers.remove(c);
-    }
-  }
-}
-
 AsyncWebSocket::AsyncWebSocketClientLinkedList AsyncWebSocket::getClients() const {
   return _clients;
 }
@@ -1341,40 +2983,110 @@ AsyncWebSocket::AsyncWebSocketClientLinkedList AsyncWebSocket::getClients() cons
  * Authentication code from https://github.com/Links2004/arduinoWebSockets/blob/master/src/WebSockets.cpp#L480
  */
 
-AsyncWebSocketResponse::AsyncWebSocketResponse(const String& key, AsyncWebSocket *server){
+static inline uint32_t webSocketRol(uint32_t x, uint8_t n){ return (x << n) | (x >> (32 - n)); }
+
+//one SHA-1 block, the message schedule kept as a ring of 16 words
+static void webSocketSha1Block(uint32_t *h, const uint8_t *block){
+  uint32_t w[16];
+  for(uint8_t i = 0; i < 16; i++)
+    w[i] = ((uint32_t)block[4 * i] << 24) | ((uint32_t)block[4 * i + 1] << 16) | ((uint32_t)block[4 * i + 2] << 8) | block[4 * i + 3];
+  uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+  auto word = [&w](uint8_t t) -> uint32_t {
+    if(t < 16)
+      return w[t];
+    w[t & 15] = webSocketRol(w[(t + 13) & 15] ^ w[(t + 8) & 15] ^ w[(t + 2) & 15] ^ w[t & 15], 1);
+    return w[t & 15];
+  };
+  auto round = [&](uint32_t f, uint32_t k, uint32_t wt){
+    uint32_t temp = webSocketRol(a, 5) + f + e + k + wt;
+    e = d;
+    d = c;
+    c = webSocketRol(b, 30);
+    b = a;
+    a = temp;
+  };
+  //one loop per round function, so none of them branches
+  uint8_t t = 0;
+  for(; t < 20; t++) round(d ^ (b & (c ^ d)), 0x5A827999, word(t));
+  for(; t < 40; t++) round(b ^ c ^ d, 0x6ED9EBA1, word(t));
+  for(; t < 60; t++) round((b & c) | (d & (b | c)), 0x8F1BBCDC, word(t));
+  for(; t < 80; t++) round(b ^ c ^ d, 0xCA62C1D6, word(t));
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+//Sec-WebSocket-Accept for a client key, 28 characters and a 0, all on the stack.
+//The key is hashed as it was sent, whatever its length, like before
+static void webSocketAcceptKey(const String& key, char *accept){
+  static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  const size_t uuidLen = 36;
+  uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+  //key and GUID streamed through one block, then the padding and the bit length
+  uint8_t block[64];
+  uint8_t used = 0;
+  auto feed = [&](uint8_t byte){
+    block[used++] = byte;
+    if(used == sizeof(block)){
+      webSocketSha1Block(h, block);
+      used = 0;
+    }
+  };
+  for(size_t i = 0; i < key.length(); i++)
+    feed((uint8_t)key[i]);
+  for(size_t i = 0; i < uuidLen; i++)
+    feed(pgm_read_byte(__WS_STR_UUID + i));
+  const uint64_t bits = (uint64_t)(key.length() + uuidLen) * 8;
+  feed(0x80);
+  while(used != 56)
+    feed(0);
+  for(int8_t shift = 56; shift >= 0; shift -= 8)
+    feed((uint8_t)(bits >> shift));
+  uint8_t hash[21];
+  for(uint8_t i = 0; i < 20; i++)
+    hash[i] = (uint8_t)(h[i / 4] >> (24 - 8 * (i & 3)));
+  hash[20] = 0;
+  //20 bytes are six groups of three and two left over, which end in one '='
+  for(uint8_t i = 0, o = 0; i < 21; i += 3, o += 4){
+    uint32_t v = ((uint32_t)hash[i] << 16) | ((uint32_t)hash[i + 1] << 8) | (i + 2 < 20 ? hash[i + 2] : 0);
+    accept[o] = table[(v >> 18) & 0x3F];
+    accept[o + 1] = table[(v >> 12) & 0x3F];
+    accept[o + 2] = table[(v >> 6) & 0x3F];
+    accept[o + 3] = (i + 2 < 20) ? table[v & 0x3F] : '=';
+  }
+  accept[28] = 0;
+}
+
+//"name: value" of an optional handshake line, the value stays where it is kept
+static size_t webSocketAddHeader(AsyncClient *client, PGM_P name, const String& value){
+  char line[32];
+  size_t len = strlen_P(name);
+  memcpy_P(line, name, len);
+  line[len++] = ':';
+  line[len++] = ' ';
+  if(client != NULL){
+    client->add(line, len, ASYNC_WRITE_FLAG_COPY);
+    client->add(value.c_str(), value.length(), ASYNC_WRITE_FLAG_COPY);
+    client->add("\r\n", 2, ASYNC_WRITE_FLAG_COPY);
+  }
+  return len + value.length() + 2;
+}
+
+AsyncWebSocketResponse::AsyncWebSocketResponse(const String& key, AsyncWebSocket *server, AsyncWebSocketDeflate *deflate, const String& extensions){
   _server = server;
+  _deflate = deflate;
+  if(deflate != NULL)
+    _extensions = extensions;
   _code = 101;
   _sendContentLength = false;
+  webSocketAcceptKey(key, _accept);
+}
 
-  uint8_t * hash = (uint8_t*)malloc(20);
-  if(hash == NULL){
-    _state = RESPONSE_FAILED;
-    return;
-  }
-  char * buffer = (char *) malloc(33);
-  if(buffer == NULL){
-    free(hash);
-    _state = RESPONSE_FAILED;
-    return;
-  }
-#ifdef ESP8266
-  sha1(key + WS_STR_UUID, hash);
-#else
-  (String&)key += WS_STR_UUID;
-  SHA1_CTX ctx;
-  SHA1Init(&ctx);
-  SHA1Update(&ctx, (const unsigned char*)key.c_str(), key.length());
-  SHA1Final(hash, &ctx);
-#endif
-  base64_encodestate _state;
-  base64_init_encodestate(&_state);
-  int len = base64_encode_block((const char *) hash, 20, buffer, &_state);
-  len = base64_encode_blockend((buffer + len), &_state);
-  addHeader(WS_STR_CONNECTION, WS_STR_UPGRADE);
-  addHeader(WS_STR_UPGRADE, F("websocket"));
-  addHeader(WS_STR_ACCEPT,buffer);
-  free(buffer);
-  free(hash);
+AsyncWebSocketResponse::~AsyncWebSocketResponse(){
+  if(_deflate != NULL)
+    delete _deflate;
 }
 
 void AsyncWebSocketResponse::_respond(AsyncWebServerRequest *request){
@@ -1382,15 +3094,48 @@ void AsyncWebSocketResponse::_respond(AsyncWebServerRequest *request){
     request->client()->close(true);
     return;
   }
-  String out = _assembleHead(request->version());
-  request->client()->write(out.c_str(), _headLength);
-  _state = RESPONSE_WAIT_ACK;
+  //fixed template on the stack, the optional protocol and extension lines are written from where they are kept.
+  //_headers only holds the DefaultHeaders of the application
+  AsyncClient *client = request->client();
+  AsyncWebHeader *protocol = request->getHeader(WS_STR_PROTOCOL);
+  char head[160];
+  size_t len = snprintf_P(head, sizeof(head), PSTR("HTTP/1.1 101 Switching Protocols\r\nConnection: Upgrade\r\nUpgrade: websocket\r\nSec-WebSocket-Accept: %s\r\n"), _accept);
+  _headLength = len + 2;
+  if(protocol != NULL)
+    _headLength += webSocketAddHeader(NULL, __WS_STR_PROTOCOL, protocol->value());
+  if(_extensions.length())
+    _headLength += webSocketAddHeader(NULL, __WS_STR_EXTENSIONS, _extensions);
+  for(const auto& header: _headers)
+    _headLength += header->name().length() + header->value().length() + 4;
+  if(client->space() < _headLength){
+    _state = RESPONSE_FAILED;
+    client->close(true);
+    return;
+  }
+  client->add(head, len, ASYNC_WRITE_FLAG_COPY);
+  if(protocol != NULL)
+    webSocketAddHeader(client, __WS_STR_PROTOCOL, protocol->value());
+  if(_extensions.length())
+    webSocketAddHeader(client, __WS_STR_EXTENSIONS, _extensions);
+  for(const auto& header: _headers){
+    client->add(header->name().c_str(), header->name().length(), ASYNC_WRITE_FLAG_COPY);
+    client->add(": ", 2, ASYNC_WRITE_FLAG_COPY);
+    client->add(header->value().c_str(), header->value().length(), ASYNC_WRITE_FLAG_COPY);
+    client->add("\r\n", 2, ASYNC_WRITE_FLAG_COPY);
+  }
+  client->add("\r\n", 2, ASYNC_WRITE_FLAG_COPY);
+  client->send();
+  _headers.free();
+  _state = RESPONSE_END;
+  //the client takes the connection over right away, frames sent behind the upgrade do not wait for the ack of the head
+  AsyncWebSocketDeflate *deflate = _deflate;
+  _deflate = NULL;
+  new AsyncWebSocketClient(request, _server, deflate, _headLength);
 }
 
 size_t AsyncWebSocketResponse::_ack(AsyncWebServerRequest *request, size_t len, uint32_t time){
+  (void)request;
+  (void)len;
   (void)time;
-  if(len){
-    new AsyncWebSocketClient(request, _server);
-  }
   return 0;
 }
@@ -32,6 +32,7 @@
 #include <ESPAsyncWebServer.h>
 
 #include "AsyncWebSynchronization.h"
+#include "AsyncWebSocketDeflate.h"
 
 #ifdef ESP8266
 #include <Hash.h>
@@ -46,8 +47,91 @@
 #define DEFAULT_MAX_WS_CLIENTS 4
 #endif
 
+//largest message assembled for an onMessage() handler
+#ifndef WS_MAX_MESSAGE_SIZE
+#ifdef ESP32
+#define WS_MAX_MESSAGE_SIZE 8192
+#else
+#define WS_MAX_MESSAGE_SIZE 2048
+#endif
+#endif
+
+//frames a client may have on the wire waiting for their ack
+#ifndef WS_MAX_UNACKED_FRAMES
+#define WS_MAX_UNACKED_FRAMES 16
+#endif
+
+//smallest size class of the message buffer pool, each further class is four times larger (64, 256, 1K, 4K)
+#ifndef WS_BUFFER_POOL_MIN_SIZE
+#define WS_BUFFER_POOL_MIN_SIZE 64
+#endif
+
+#ifndef WS_BUFFER_POOL_CLASSES
+#define WS_BUFFER_POOL_CLASSES 4
+#endif
+
+//unused buffers kept per size class, 0 disables the pool
+#ifndef WS_BUFFER_POOL_MAX_FREE
+#ifdef ESP32
+#define WS_BUFFER_POOL_MAX_FREE 4
+#else
+#define WS_BUFFER_POOL_MAX_FREE 2
+#endif
+#endif
+
+//bytes of messages one client may have queued
+#ifndef WS_MAX_QUEUED_BYTES
+#ifdef ESP32
+#define WS_MAX_QUEUED_BYTES 16384
+#else
+#define WS_MAX_QUEUED_BYTES 4096
+#endif
+#endif
+
+//bytes of messages all clients of a socket may have queued together
+#ifndef WS_MAX_QUEUED_BYTES_TOTAL
+#ifdef ESP32
+#define WS_MAX_QUEUED_BYTES_TOTAL 65536
+#else
+#define WS_MAX_QUEUED_BYTES_TOTAL 12288
+#endif
+#endif
+
+//payload of one frame of a streamed message, the only buffer it needs
+#ifndef WS_STREAM_CHUNK_SIZE
+#define WS_STREAM_CHUNK_SIZE 1436
+#endif
+
+//resolution of the keep-alive and idle timers in ms
+#ifndef WS_TIMER_TICK
+#define WS_TIMER_TICK 250
+#endif
+
+//seconds to wait for the pong of a keep-alive ping before the client is closed as dead
+#ifndef WS_PONG_TIMEOUT
+#define WS_PONG_TIMEOUT 10
+#endif
+
+//buckets of the round trip histogram, see AwsRttHistogram
+#ifndef WS_RTT_BUCKETS
+#define WS_RTT_BUCKETS 12
+#endif
+
+//default of setUtf8Validation()
+#ifndef WS_VALIDATE_UTF8
+#define WS_VALIDATE_UTF8 false
+#endif
+
+//ms that frames sent without a copy are kept after the peer closed with them unacked.
+//lwIP gives such a connection up after 2 * TCP_MSL in LAST_ACK
+#ifndef WS_ZERO_COPY_LINGER
+#define WS_ZERO_COPY_LINGER 120000
+#endif
+
 class AsyncWebSocket;
 class AsyncWebSocketResponse;
+class AsyncWebSocketMultiMessage;
+class AsyncWebSocketBufferPool;
 class AsyncWebSocketClient;
 class AsyncWebSocketControl;
 
@@ -75,17 +159,73 @@ typedef struct {
     uint64_t index;
 } AwsFrameInfo;
 
+//where the UTF-8 check of a text message stands, carried over frames and TCP segments
+typedef struct {
+    /** Continuation bytes still missing of the last character. */
+    uint8_t need;
+    /** Range of the next one, narrower after E0, ED, F0 and F4. */
+    uint8_t lower;
+    uint8_t upper;
+} AwsUtf8State;
+
 typedef enum { WS_DISCONNECTED, WS_CONNECTED, WS_DISCONNECTING } AwsClientStatus;
 typedef enum { WS_CONTINUATION, WS_TEXT, WS_BINARY, WS_DISCONNECT = 0x08, WS_PING, WS_PONG } AwsFrameType;
 typedef enum { WS_MSG_SENDING, WS_MSG_SENT, WS_MSG_ERROR } AwsMessageStatus;
+//what became of a queued message: every byte handed to TCP, acked by the peer, or never delivered
+typedef enum { WS_MSG_EVT_SENT, WS_MSG_EVT_ACKED, WS_MSG_EVT_DROPPED } AwsMessageEventType;
 typedef enum { WS_EVT_CONNECT, WS_EVT_DISCONNECT, WS_EVT_PONG, WS_EVT_ERROR, WS_EVT_DATA } AwsEventType;
+//what happens to a message that does not fit in the send queue
+typedef enum { WS_QUEUE_DROP_NEWEST, WS_QUEUE_DROP_OLDEST, WS_QUEUE_CONFLATE, WS_QUEUE_DISCONNECT } AwsQueuePolicy;
+//order in which queued messages go out, e.g. interactive replies, telemetry, bulk transfers
+typedef enum { WS_PRIORITY_HIGH, WS_PRIORITY_NORMAL, WS_PRIORITY_LOW } AwsMessagePriority;
+//what a handshake gets when the socket has its maximum of clients, see AsyncWebSocket::setMaxClients()
+typedef enum { WS_LIMIT_REJECT, WS_LIMIT_EVICT_OLDEST_IDLE, WS_LIMIT_EVICT_LOWEST_PRIORITY } AwsClientLimitPolicy;
+
+typedef struct {
+    /** Messages dropped because the queue was over its budget. */
+    uint32_t dropped;
+    /** Bytes of those messages. */
+    uint32_t droppedBytes;
+    /** Queued messages replaced by a newer one with the same key. */
+    uint32_t conflated;
+    /** Clients closed because their queue was over its budget. */
+    uint32_t disconnects;
+} AwsQueueStats;
+
+typedef struct {
+    /** Pongs by round trip: bucket 0 counts the ones under 1ms, bucket i the ones under 2^i ms, the last one all slower. */
+    uint32_t buckets[WS_RTT_BUCKETS];
+    /** Pongs measured. */
+    uint32_t samples;
+    /** Slowest round trip seen, in microseconds. */
+    uint32_t max;
+} AwsRttHistogram;
+
+//room left in front of every message buffer for the largest server frame header
+#define WS_FRAME_HEADROOM 10
 
 class AsyncWebSocketMessageBuffer {
   private:
+    uint8_t * _buffer;
     uint8_t * _data;
     size_t _len;
     bool _lock;
     uint32_t _count;
+    uint8_t _frameOpcode;
+    uint8_t _frameHeadLen;
+    bool _compressed; //holds a deflated message, its frame carries RSV1
+    AsyncWebSocketMessageBuffer * _deflated; //compressed copy shared by clients without context takeover
+    uint8_t _deflatedBits; //window of that copy, 0 until it was tried
+    uint32_t _key;
+    uint8_t _priority;
+    size_t _capacity;
+    AsyncWebSocketBufferPool * _pool; //the buffer goes back there once nothing refers to it
+    AsyncWebSocketMessageBuffer * _nextFree;
+    AsyncWebSocketMessageBuffer * _prevLive; //handed out by the pool, see AsyncWebSocketBufferPool::reclaim()
+    AsyncWebSocketMessageBuffer * _nextLive;
+
+    bool _allocate(size_t size);
+    void _reset(size_t size);
 
   public:
     AsyncWebSocketMessageBuffer();
@@ -95,31 +235,173 @@ class AsyncWebSocketMessageBuffer {
     AsyncWebSocketMessageBuffer(AsyncWebSocketMessageBuffer &&);
     ~AsyncWebSocketMessageBuffer();
     void operator ++(int i) { (void)i; _count++; }
-    void operator --(int i) { (void)i; if (_count > 0) { _count--; } ;  }
+    void operator --(int i);
     bool reserve(size_t size);
     void lock() { _lock = true; }
-    void unlock() { _lock = false; }
+    void unlock();
     uint8_t * get() { return _data; }
     size_t length() { return _len; }
     uint32_t count() { return _count; }
+    //the whole unmasked frame (header + payload), built once and shared by every client
+    uint8_t * frame(uint8_t opcode);
+    size_t frameLength() const { return _frameHeadLen + _len; }
+    size_t capacity() const { return _capacity; }
     bool canDelete() { return (!_count && !_lock); }
+    //messages made from this buffer carry the key, see WS_QUEUE_CONFLATE
+    void setKey(uint32_t key) { _key = key; }
+    uint32_t key() const { return _key; }
+    //and the priority
+    void setPriority(AwsMessagePriority priority) { _priority = priority; }
+    AwsMessagePriority priority() const { return (AwsMessagePriority)_priority; }
+    //the compressed copy for a client that accepts windowBits, NULL when it does not pay off or needs a smaller window
+    AsyncWebSocketMessageBuffer * deflated(uint8_t windowBits, size_t minSize);
 
     friend AsyncWebSocket;
+    friend AsyncWebSocketMultiMessage;
+    friend AsyncWebSocketBufferPool;
+
+};
+
+typedef struct {
+    /** Buffers handed out by makeBuffer(). */
+    uint32_t acquired;
+    /** Of those, the ones taken from the pool instead of allocated. */
+    uint32_t reused;
+    /** Buffers given back once every message using them was sent. */
+    uint32_t released;
+    /** Buffers in use. */
+    uint16_t live;
+    /** Unused buffers kept for reuse, and their size. */
+    uint16_t pooled;
+    size_t pooledBytes;
+} AwsBufferPoolStats;
+
+/*
+ * BUFFER POOL :: Unused message buffers kept by size class.
+ * A buffer returns when its last message is gone, and the next makeBuffer() of that class takes it
+ * */
+
+class AsyncWebSocketBufferPool {
+  private:
+    AsyncWebSocketMessageBuffer * _free[WS_BUFFER_POOL_CLASSES];
+    AsyncWebSocketMessageBuffer * _live; //buffers handed out and not given back yet
+    uint8_t _freeCount[WS_BUFFER_POOL_CLASSES];
+    AwsBufferPoolStats _stats;
+    AsyncWebLock _lock;
+    static size_t _classSize(uint8_t c){ return (size_t)WS_BUFFER_POOL_MIN_SIZE << (2 * c); }
+    bool _releaseLocked(AsyncWebSocketMessageBuffer * buffer);
+
+  public:
+    AsyncWebSocketBufferPool();
+    ~AsyncWebSocketBufferPool();
+    AsyncWebSocketBufferPool(const AsyncWebSocketBufferPool &) = delete;
+    AsyncWebSocketBufferPool &operator=(const AsyncWebSocketBufferPool &) = delete;
+    AsyncWebSocketMessageBuffer * acquire(size_t size);
+    void release(AsyncWebSocketMessageBuffer * buffer);
+    //gives back the buffers that are neither locked nor used by a message, like one that was made and never sent
+    void reclaim();
+    const AwsBufferPoolStats & stats() const { return _stats; }
+};
+
+//the next deadline of a client, linked into the timer wheel of its socket
+class AsyncWebSocketTimer {
+  private:
+    AsyncWebSocketTimer * _prev;
+    AsyncWebSocketTimer * _next;
+    AsyncWebSocketTimer ** _list; //head of the slot the timer is in, NULL while not armed
+    uint32_t _deadline; //in ticks
+  public:
+    AsyncWebSocketClient * client;
+    AsyncWebSocketTimer(AsyncWebSocketClient * c): _prev(nullptr), _next(nullptr), _list(nullptr), _deadline(0), client(c) {}
+    bool armed() const { return _list != nullptr; }
+
+    friend class AsyncWebSocketTimerWheel;
+};
+
+/*
+ * TIMER WHEEL :: Keep-alive, pong and idle deadlines of all clients of a socket.
+ * Two levels of slots: one per tick, then one per turn of the first level. Advancing
+ * touches only the slots that come due, so the cost follows the expiring timers, not the clients
+ * */
+
+class AsyncWebSocketTimerWheel {
+  private:
+    static const uint8_t SLOT_BITS = 5;
+    static const uint32_t SLOTS = 1 << SLOT_BITS;
+    AsyncWebSocketTimer * _wheel[2][SLOTS];
+    AsyncWebSocketTimer * _expired; //batch of the current tick
+    uint32_t _tick;
+    uint32_t _tickTime; //millis() of _tick
+    size_t _count;
+
+    void _link(AsyncWebSocketTimer ** list, AsyncWebSocketTimer * timer);
+    void _place(AsyncWebSocketTimer * timer);
 
+  public:
+    AsyncWebSocketTimerWheel();
+    AsyncWebSocketTimerWheel(const AsyncWebSocketTimerWheel &) = delete;
+    AsyncWebSocketTimerWheel &operator=(const AsyncWebSocketTimerWheel &) = delete;
+    //(re)arms the timer to expire in ms
+    void schedule(AsyncWebSocketTimer * timer, uint32_t ms);
+    void cancel(AsyncWebSocketTimer * timer);
+    //moves the wheel to now and calls _onTimer() of the clients whose deadline passed
+    void advance(uint32_t now);
+    size_t count() const { return _count; }
 };
 
+typedef std::function<void(AwsMessageEventType type)> AwsMessageEventHandler;
+
 class AsyncWebSocketMessage {
   protected:
     uint8_t _opcode;
     bool _mask;
+    bool _compressed;
     AwsMessageStatus _status;
+    uint32_t _key;
+    uint8_t _priority;
+    AwsMessageEventHandler _eventHandler;
+    uint8_t _events; //bit per AwsMessageEventType already reported
   public:
-    AsyncWebSocketMessage():_opcode(WS_TEXT),_mask(false),_status(WS_MSG_ERROR){}
+    AsyncWebSocketMessage():_opcode(WS_TEXT),_mask(false),_compressed(false),_status(WS_MSG_ERROR),_key(0),_priority(WS_PRIORITY_NORMAL),_events(0){}
     virtual ~AsyncWebSocketMessage(){}
     virtual void ack(size_t len __attribute__((unused)), uint32_t time __attribute__((unused))){}
     virtual size_t send(AsyncClient *client __attribute__((unused))){ return 0; }
     virtual bool finished(){ return _status != WS_MSG_SENDING; }
     virtual bool betweenFrames() const { return false; }
+    virtual bool readyToSend() const { return betweenFrames(); }
+    //called once when the message is queued for a client with permessage-deflate
+    virtual void deflate(AsyncWebSocketDeflate *deflate __attribute__((unused))){}
+    //bytes the message holds in the queue
+    virtual size_t size() const { return 0; }
+    //a message that is partly on the wire can not be dropped any more
+    virtual bool started() const { return false; }
+    //every byte was handed to the TCP stack, the next message may follow before the acks come
+    virtual bool written() const { return false; }
+    //the TCP stack may still read memory of the message, it was added without a copy and is not acked
+    virtual bool inFlight() const { return false; }
+    //with WS_QUEUE_CONFLATE a queued message is replaced by a newer one with the same non zero key
+    void setKey(uint32_t key){ _key = key; }
+    uint32_t key() const { return _key; }
+    //queued ahead of messages of lower priority that have not started yet
+    void setPriority(AwsMessagePriority priority){ _priority = priority; }
+    AwsMessagePriority priority() const { return (AwsMessagePriority)_priority; }
+    //WS_MSG_EVT_SENT and then WS_MSG_EVT_ACKED, or WS_MSG_EVT_DROPPED, each reported once
+    void onEvent(AwsMessageEventHandler handler){ _eventHandler = handler; }
+    void _notify(AwsMessageEventType type){
+      if(!_eventHandler || (_events & (1 << type)))
+        return;
+      _events |= (1 << type);
+      _eventHandler(type);
+    }
+    //the client is done with the message, right before it is deleted
+    void _released(){
+      if(_status == WS_MSG_SENT){
+        _notify(WS_MSG_EVT_SENT);
+        _notify(WS_MSG_EVT_ACKED);
+      } else {
+        _notify(WS_MSG_EVT_DROPPED);
+      }
+    }
 };
 
 class AsyncWebSocketBasicMessage: public AsyncWebSocketMessage {
@@ -136,6 +418,10 @@ public:
     virtual bool betweenFrames() const override { return _acked == _ack; }
     virtual void ack(size_t len, uint32_t time) override ;
     virtual size_t send(AsyncClient *client) override ;
+    virtual void deflate(AsyncWebSocketDeflate *deflate) override ;
+    virtual size_t size() const override { return _len; }
+    virtual bool started() const override { return _sent > 0; }
+    virtual bool written() const override { return _len && _sent == _len; }
 };
 
 class AsyncWebSocketMultiMessage: public AsyncWebSocketMessage {
@@ -145,13 +431,81 @@ class AsyncWebSocketMultiMessage: public AsyncWebSocketMessage {
     size_t _sent;
     size_t _ack;
     size_t _acked;
+    bool _framed; //_data is the prebuilt frame of the buffer, sent as it is
+    uint8_t * _owned; //compressed copy made for this client only
     AsyncWebSocketMessageBuffer * _WSbuffer;
+    size_t _sendFrame(AsyncClient *client);
 public:
     AsyncWebSocketMultiMessage(AsyncWebSocketMessageBuffer * buffer, uint8_t opcode=WS_TEXT, bool mask=false);
     virtual ~AsyncWebSocketMultiMessage() override;
-    virtual bool betweenFrames() const override { return _acked == _ack; }
+    virtual bool betweenFrames() const override { return _framed ? (_sent == 0 || _sent == _len) : _acked == _ack; }
+    virtual bool readyToSend() const override { return _framed ? _sent < _len : _acked == _ack; }
+    virtual void ack(size_t len, uint32_t time) override ;
+    virtual size_t send(AsyncClient *client) override ;
+    virtual void deflate(AsyncWebSocketDeflate *deflate) override ;
+    virtual size_t size() const override { return _len; }
+    virtual bool started() const override { return _sent > 0; }
+    virtual bool written() const override { return _len && _sent == _len; }
+    virtual bool inFlight() const override { return _framed && _acked < _ack; }
+};
+
+/*
+ * STREAM MESSAGE :: A message of any length read from a file or a filler callback as it is sent.
+ * Each frame is read into one chunk buffer, which is allocated when sending starts and freed at the end
+ * */
+
+class AsyncWebSocketStreamMessage: public AsyncWebSocketMessage {
+  private:
+    fs::File _file;
+    AwsResponseFiller _filler;
+    size_t _len; //0 when the filler tells the end by returning 0
+    size_t _index;
+    size_t _chunk;
+    uint8_t * _buffer;
+    size_t _ack;
+    size_t _acked;
+    bool _ended; //the final frame is written
+public:
+    AsyncWebSocketStreamMessage(fs::File file, uint8_t opcode=WS_BINARY, size_t chunk=WS_STREAM_CHUNK_SIZE);
+    //the filler works like the one of a chunked response, it may return RESPONSE_TRY_AGAIN
+    AsyncWebSocketStreamMessage(AwsResponseFiller filler, size_t len=0, uint8_t opcode=WS_BINARY, size_t chunk=WS_STREAM_CHUNK_SIZE);
+    virtual ~AsyncWebSocketStreamMessage() override;
+    virtual bool betweenFrames() const override { return true; }
+    virtual bool readyToSend() const override { return !_ended; }
+    virtual void ack(size_t len, uint32_t time) override ;
+    virtual size_t send(AsyncClient *client) override ;
+    virtual size_t size() const override { return _chunk; }
+    virtual bool started() const override { return _ack > 0; }
+    virtual bool written() const override { return _ended; }
+};
+
+typedef std::function<void(bool acked)> AwsMessageReleaseHandler;
+
+/*
+ * REFERENCE MESSAGE :: Sends memory the caller owns without copying it.
+ * The memory must stay unchanged until onRelease, which tells whether the whole message was acked
+ * */
+
+class AsyncWebSocketRefMessage: public AsyncWebSocketMessage {
+  private:
+    const uint8_t * _data;
+    size_t _len;
+    size_t _sent;
+    size_t _ack;
+    size_t _acked;
+    AwsMessageReleaseHandler _onRelease;
+public:
+    AsyncWebSocketRefMessage(const uint8_t * data, size_t len, uint8_t opcode=WS_BINARY, AwsMessageReleaseHandler onRelease=nullptr);
+    virtual ~AsyncWebSocketRefMessage() override;
+    virtual bool betweenFrames() const override { return true; }
+    virtual bool readyToSend() const override { return _sent < _len; }
     virtual void ack(size_t len, uint32_t time) override ;
     virtual size_t send(AsyncClient *client) override ;
+    //holds none of the socket's memory, so it does not count against the queue budget
+    virtual size_t size() const override { return 0; }
+    virtual bool started() const override { return _sent > 0; }
+    virtual bool written() const override { return _len && _sent == _len; }
+    virtual bool inFlight() const override { return _acked < _ack; }
 };
 
 class AsyncWebSocketClient {
@@ -166,19 +520,64 @@ class AsyncWebSocketClient {
 
     uint8_t _pstate;
     AwsFrameInfo _pinfo;
+    uint8_t _phead[14]; //frame header carried over from the previous segment
+    uint8_t _pheadLen;
+    uint8_t *_pcontrol; //control frame payload split over segments
+    size_t _queuedBytes;
+    AwsQueueStats _queueStats;
+
+    struct AckEntry {
+      AsyncWebSocketMessage *message; //NULL for a control frame, or once the message left the queue
+      bool control;
+      size_t len;
+    };
+    AckEntry _unacked[WS_MAX_UNACKED_FRAMES]; //frames on the wire in send order
+    uint8_t _unackedHead;
+    uint8_t _unackedCount;
+    size_t _handshakeUnacked; //bytes of the 101 response that are still on the wire, before any frame
+    bool _pcompressed; //the message being received has RSV1 set
+    bool _putf8; //the message being received is text that gets checked for UTF-8
+    uint8_t _priority; //AwsMessagePriority of the client, for eviction
+    AwsUtf8State _utf8;
+    AsyncWebSocketMessageBuffer *_assembly; //message collected for an onMessage() handler
+    size_t _assemblyLen;
+    AsyncWebSocketDeflate *_deflate; //NULL unless permessage-deflate was negotiated
 
     uint32_t _lastMessageTime;
     uint32_t _keepAlivePeriod;
-
+    uint32_t _pingTime; //last keep-alive ping
+    bool _pongPending;
+    uint32_t _pingSeq; //sequence number of the last measuring ping
+    uint32_t _rtt; //smoothed round trip and its mean deviation, in microseconds
+    uint32_t _rttJitter;
+    bool _drainPending; //messages were queued since the last drain
+    bool _closing; //close frame sent, the handshake has until _closeTime + close wait to finish
+    bool _aborted; //the connection was aborted or failed, the TCP stack let go of every frame
+    bool _lingering; //the stack closed the connection, frames sent without a copy may still be retransmitted
+    uint32_t _closeTime;
+    AsyncWebSocketTimer _timer;
+
+    size_t _parseHeader(const uint8_t *data, size_t len);
+    bool _inflateData(uint8_t *data, size_t len, bool last);
+    bool _assembleData(uint8_t *data, size_t len, bool last);
+    void _deliverMessage(uint8_t opcode, uint8_t *data, size_t len);
+    void _failConnection(uint16_t code);
+    bool _onPong(const uint8_t *payload, size_t len);
     void _queueMessage(AsyncWebSocketMessage *dataMessage);
+    bool _queueFits(size_t size);
+    bool _admitMessage(AsyncWebSocketMessage *dataMessage);
+    void _dropMessage(AsyncWebSocketMessage *dataMessage, bool conflated);
     void _queueControl(AsyncWebSocketControl *controlMessage);
     void _runQueue();
+    void _addUnacked(AsyncWebSocketMessage *message, size_t len);
     void _clearQueue();
+    bool _inFlight();
+    void _releaseMessage(AsyncWebSocketMessage *message);
 
   public:
     void *_tempObject;
 
-    AsyncWebSocketClient(AsyncWebServerRequest *request, AsyncWebSocket *server);
+    AsyncWebSocketClient(AsyncWebServerRequest *request, AsyncWebSocket *server, AsyncWebSocketDeflate *deflate = NULL, size_t handshakeLen = 0);
     ~AsyncWebSocketClient();
 
     //client id increments for the given server
@@ -187,6 +586,17 @@ class AsyncWebSocketClient {
     AsyncClient* client(){ return _client; }
     AsyncWebSocket *server(){ return _server; }
     AwsFrameInfo const &pinfo() const { return _pinfo; }
+    bool permessageDeflate() const { return _deflate != NULL; }
+    //clients of low priority make room for new ones first, see AsyncWebSocket::setMaxClients()
+    void setPriority(AwsMessagePriority priority){ _priority = priority; }
+    AwsMessagePriority priority() const { return (AwsMessagePriority)_priority; }
+    //millis() when the peer was last heard from (data, pong or ack)
+    uint32_t lastActivity() const { return _lastMessageTime; }
+
+    //topics this client gets messages of, see AsyncWebSocket::publish()
+    bool subscribe(uint32_t topic);
+    void unsubscribe(uint32_t topic);
+    bool subscribed(uint32_t topic);
 
     IPAddress remoteIP();
     uint16_t  remotePort();
@@ -194,11 +604,14 @@ class AsyncWebSocketClient {
     //control frames
     void close(uint16_t code=0, const char * message=NULL);
     void ping(uint8_t *data=NULL, size_t len=0);
-
-    //set auto-ping period in seconds. disabled if zero (default)
-    void keepAlivePeriod(uint16_t seconds){
-      _keepAlivePeriod = seconds * 1000;
-    }
+    //a ping carrying a sequence number and time stamp, its pong updates rtt(). Keep-alive pings do the same
+    void measureRtt();
+    //smoothed round trip time and its mean deviation (jitter) in microseconds, 0 until the first pong
+    uint32_t rtt() const { return _rtt; }
+    uint32_t rttJitter() const { return _rttJitter; }
+
+    //set auto-ping period in seconds. disabled if zero (default, see AsyncWebSocket::setKeepAlive())
+    void keepAlivePeriod(uint16_t seconds);
     uint16_t keepAlivePeriod(){
       return (uint16_t)(_keepAlivePeriod / 1000);
     }
@@ -207,6 +620,8 @@ class AsyncWebSocketClient {
     void message(AsyncWebSocketMessage *message){ _queueMessage(message); }
     bool queueIsFull();
     size_t queueLen() { return _messageQueue.length() + _controlQueue.length(); }
+    size_t queuedBytes() const { return _queuedBytes; }
+    const AwsQueueStats & queueStats() const { return _queueStats; }
 
     size_t printf(const char *format, ...)  __attribute__ ((format (printf, 2, 3)));
 #ifndef ESP32
@@ -228,19 +643,42 @@ class AsyncWebSocketClient {
     void binary(const __FlashStringHelper *data, size_t len);
     void binary(AsyncWebSocketMessageBuffer *buffer);
 
-    bool canSend() { return _messageQueue.length() < WS_MAX_QUEUED_MESSAGES; }
+    bool canSend() { return !queueIsFull(); }
 
     //system callbacks (do not call)
     void _onAck(size_t len, uint32_t time);
     void _onError(int8_t);
     void _onPoll();
     void _onTimeout(uint32_t time);
+    void _onTimer();
+    void _armTimer();
     void _onDisconnect();
     void _onData(void *pbuf, size_t plen);
+    void _detach();
+    void _closeNow();
+};
+
+//subscribers of one topic, kept by the socket
+class AsyncWebSocketTopic {
+  public:
+    uint32_t id;
+    LinkedList<AsyncWebSocketClient *> subscribers;
+    AsyncWebSocketTopic(uint32_t topic): id(topic), subscribers(nullptr) {}
+};
+
+//a message whose memory the TCP stack may still read after its connection was closed, kept by the socket until it can not
+class AsyncWebSocketRetiredMessage {
+  public:
+    AsyncWebSocketMessage * message;
+    uint32_t since;
+    AsyncWebSocketRetiredMessage(AsyncWebSocketMessage * m, uint32_t t): message(m), since(t) {}
+    ~AsyncWebSocketRetiredMessage(){ message->_released(); delete message; }
 };
 
 typedef std::function<bool(AsyncWebServerRequest *request)> AwsHandshakeHandler;
 typedef std::function<void(AsyncWebSocket * server, AsyncWebSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len)> AwsEventHandler;
+typedef std::function<void(AsyncWebSocket * server, AsyncWebSocketClient * client, AwsFrameType type, uint8_t *data, size_t len)> AwsMessageHandler;
+typedef std::function<void(AsyncWebSocket * server, AsyncWebSocketClient * client)> AwsDrainHandler;
 
 //WebServer Handler implementation that plays the role of a socket server
 class AsyncWebSocket: public AsyncWebHandler {
@@ -248,12 +686,52 @@ class AsyncWebSocket: public AsyncWebHandler {
     typedef LinkedList<AsyncWebSocketClient *> AsyncWebSocketClientLinkedList;
   private:
     String _url;
+    AsyncWebSocketBufferPool _bufferPool; //outlives the clients, their messages give buffers back
+    AsyncWebSocketTimerWheel _timers;
     AsyncWebSocketClientLinkedList _clients;
+    AsyncWebSocketClient ** _clientIndex; //open addressing by id, linear probing
+    uint8_t _clientIndexBits;
+    uint16_t _clientIndexCount;
     uint32_t _cNextId;
+    LinkedList<AsyncWebSocketTopic *> _topics;
+    AsyncWebSocketTopic ** _topicIndex; //open addressing by topic, linear probing like the client index
+    uint8_t _topicIndexBits;
+    uint16_t _topicIndexCount;
+    LinkedList<AsyncWebSocketRetiredMessage *> _retired; //oldest first
     AwsEventHandler _eventHandler;
+    AwsMessageHandler _messageHandler;
+    AwsDrainHandler _drainHandler;
+    size_t _maxMessageSize;
 	AwsHandshakeHandler _handshakeHandler;
     bool _enabled;
-    AsyncWebLock _lock;
+    bool _deflateEnabled;
+    bool _utf8Validation;
+    uint8_t _deflateWindowBits;
+    bool _deflateContextTakeover;
+    size_t _deflateMaxSize;
+    size_t _deflateMinSize;
+    size_t _maxClientQueuedBytes;
+    size_t _maxQueuedBytes;
+    size_t _queuedBytes;
+    AwsQueuePolicy _queuePolicy;
+    AwsQueueStats _queueStats;
+    AwsRttHistogram _rttHistogram;
+    uint16_t _keepAlive;
+    uint16_t _pongTimeout;
+    uint16_t _idleTimeout;
+    uint16_t _maxClients;
+    AwsClientLimitPolicy _clientLimitPolicy;
+
+    size_t _indexSlot(uint32_t id) const { return (uint32_t)(id * 2654435761u) >> (32 - _clientIndexBits); }
+    AsyncWebSocketClient * _findClient(uint32_t id) const;
+    size_t _topicSlot(uint32_t topic) const { return (uint32_t)(topic * 2654435761u) >> (32 - _topicIndexBits); }
+    AsyncWebSocketTopic * _findTopic(uint32_t topic) const;
+    bool _indexTopic(AsyncWebSocketTopic * t);
+    void _dropTopic(AsyncWebSocketTopic * t);
+    bool _reserveClient();
+    bool _indexClient(AsyncWebSocketClient * client);
+    void _unindexClient(uint32_t id);
+    bool _evictClient();
 
   public:
     AsyncWebSocket(const String& url);
@@ -261,6 +739,38 @@ class AsyncWebSocket: public AsyncWebHandler {
     const char * url() const { return _url.c_str(); }
     void enable(bool e){ _enabled = e; }
     bool enabled() const { return _enabled; }
+
+    //permessage-deflate for clients that offer it. Context takeover compresses better, but costs a window per client
+    void setDeflate(bool enable, uint8_t windowBits = WS_DEFLATE_WINDOW_BITS, bool contextTakeover = false);
+    //largest incoming compressed message and smallest outgoing message worth compressing
+    void setDeflateLimits(size_t maxMessageSize, size_t minSize = WS_DEFLATE_MIN_SIZE);
+    bool deflateEnabled() const { return _deflateEnabled; }
+
+    //closes clients that send text messages that are not valid UTF-8 with 1007, before the handlers see them
+    void setUtf8Validation(bool enable){ _utf8Validation = enable; }
+    bool utf8Validation() const { return _utf8Validation; }
+
+    //byte budgets of the send queues, and what to do with a message that does not fit
+    void setQueueLimits(size_t clientBytes, size_t totalBytes = WS_MAX_QUEUED_BYTES_TOTAL);
+    void setQueuePolicy(AwsQueuePolicy policy){ _queuePolicy = policy; }
+    AwsQueuePolicy queuePolicy() const { return _queuePolicy; }
+    size_t queuedBytes() const { return _queuedBytes; }
+    //totals of all clients, including the ones that are gone
+    const AwsQueueStats & queueStats() const { return _queueStats; }
+
+    //pings clients that were quiet for interval seconds and closes the ones whose pong does not come within
+    //pongTimeout. Applies to clients that connect later, 0 disables
+    void setKeepAlive(uint16_t interval, uint16_t pongTimeout = WS_PONG_TIMEOUT);
+    uint16_t keepAlive() const { return _keepAlive; }
+    uint16_t pongTimeout() const { return _pongTimeout; }
+    //closes clients nothing was heard from (data, pong or ack) for that many seconds, 0 disables
+    void setIdleTimeout(uint16_t seconds);
+    uint16_t idleTimeout() const { return _idleTimeout; }
+
+    //round trips of the measuring pings of all clients
+    const AwsRttHistogram & rttHistogram() const { return _rttHistogram; }
+    void resetRttHistogram();
+
     bool availableForWriteAll();
     bool availableForWrite(uint32_t id);
 
@@ -270,7 +780,12 @@ class AsyncWebSocket: public AsyncWebHandler {
 
     void close(uint32_t id, uint16_t code=0, const char * message=NULL);
     void closeAll(uint16_t code=0, const char * message=NULL);
+    //also gives back buffers from makeBuffer() that were not sent and are not locked
     void cleanupClients(uint16_t maxClients = DEFAULT_MAX_WS_CLIENTS);
+    //checked once the handshake is found valid, before the new client is allocated. Counts clients that are still
+    //closing too. A full socket answers 503 or drops another client, 0 disables the limit (default)
+    void setMaxClients(uint16_t maxClients = DEFAULT_MAX_WS_CLIENTS, AwsClientLimitPolicy policy = WS_LIMIT_REJECT);
+    uint16_t maxClients() const { return _maxClients; }
 
     void ping(uint32_t id, uint8_t *data=NULL, size_t len=0);
     void pingAll(uint8_t *data=NULL, size_t len=0); //  done
@@ -308,6 +823,16 @@ class AsyncWebSocket: public AsyncWebHandler {
     void message(uint32_t id, AsyncWebSocketMessage *message);
     void messageAll(AsyncWebSocketMultiMessage *message);
 
+    //publish/subscribe: a topic exists while it has subscribers
+    bool subscribe(uint32_t id, uint32_t topic);
+    void unsubscribe(uint32_t id, uint32_t topic);
+    bool subscribed(uint32_t id, uint32_t topic) const;
+    size_t subscribers(uint32_t topic) const;
+    //sends the buffer to the subscribers of the topic only, framed once for all of them
+    void publish(uint32_t topic, AsyncWebSocketMessageBuffer * buffer, AwsFrameType type = WS_TEXT);
+    void publish(uint32_t topic, const char * message, size_t len, AwsFrameType type = WS_TEXT);
+    void publish(uint32_t topic, const String &message, AwsFrameType type = WS_TEXT);
+
     size_t printf(uint32_t id, const char *format, ...)  __attribute__ ((format (printf, 3, 4)));
     size_t printfAll(const char *format, ...)  __attribute__ ((format (printf, 2, 3)));
 #ifndef ESP32
@@ -320,16 +845,40 @@ class AsyncWebSocket: public AsyncWebHandler {
       _eventHandler = handler;
     }
 
+    //whole messages instead of WS_EVT_DATA fragments. Larger ones close the connection with 1009
+    void onMessage(AwsMessageHandler handler, size_t maxSize = WS_MAX_MESSAGE_SIZE){
+      _messageHandler = handler;
+      _maxMessageSize = maxSize;
+    }
+    size_t maxMessageSize() const { return _maxMessageSize; }
+
+    //a client has every message queued for it acked and nothing left to send
+    void onDrain(AwsDrainHandler handler){
+      _drainHandler = handler;
+    }
+
     // Handshake Handler
     void handleHandshake(AwsHandshakeHandler handler){
       _handshakeHandler = handler; 
     }
 	
     //system callbacks (do not call)
-    uint32_t _getNextId(){ return _cNextId++; }
+    uint32_t _getNextId();
+    bool _queueFits(size_t clientQueued, size_t size) const;
+    void _queueAdd(size_t size){ _queuedBytes += size; }
+    void _queueRemove(size_t size){ _queuedBytes -= (size < _queuedBytes) ? size : _queuedBytes; }
+    void _queueDropped(size_t size, bool conflated, bool disconnect);
+    void _rttSample(uint32_t us);
     void _addClient(AsyncWebSocketClient * client);
     void _handleDisconnect(AsyncWebSocketClient * client);
     void _handleEvent(AsyncWebSocketClient * client, AwsEventType type, void * arg, uint8_t *data, size_t len);
+    bool _assembling() const { return _messageHandler != nullptr; }
+    void _handleMessage(AsyncWebSocketClient * client, AwsFrameType type, uint8_t *data, size_t len);
+    void _handleDrain(AsyncWebSocketClient * client){ if(_drainHandler) _drainHandler(this, client); }
+    void _releaseBuffer(AsyncWebSocketMessageBuffer * buffer){ _bufferPool.release(buffer); }
+    void _retire(AsyncWebSocketMessage * message);
+    void _reapRetired();
+    AsyncWebSocketTimerWheel & _timerWheel(){ return _timers; }
     virtual bool canHandle(AsyncWebServerRequest *request) override final;
     virtual void handleRequest(AsyncWebServerRequest *request) override final;
 
@@ -337,8 +886,7 @@ class AsyncWebSocket: public AsyncWebHandler {
     //  messagebuffer functions/objects.
     AsyncWebSocketMessageBuffer * makeBuffer(size_t size = 0);
     AsyncWebSocketMessageBuffer * makeBuffer(uint8_t * data, size_t size);
-    LinkedList<AsyncWebSocketMessageBuffer *> _buffers;
-    void _cleanBuffers();
+    const AwsBufferPoolStats & bufferPoolStats() const { return _bufferPool.stats(); }
 
     AsyncWebSocketClientLinkedList getClients() const;
 };
@@ -346,10 +894,13 @@ class AsyncWebSocket: public AsyncWebHandler {
 //WebServer response to authenticate the socket and detach the tcp client from the web server request
 class AsyncWebSocketResponse: public AsyncWebServerResponse {
   private:
-    String _content;
     AsyncWebSocket *_server;
+    AsyncWebSocketDeflate *_deflate; //handed to the client once the handshake is sent
+    char _accept[29]; //Sec-WebSocket-Accept
+    String _extensions; //negotiated Sec-WebSocket-Extensions, empty without permessage-deflate
   public:
-    AsyncWebSocketResponse(const String& key, AsyncWebSocket *server);
+    AsyncWebSocketResponse(const String& key, AsyncWebSocket *server, AsyncWebSocketDeflate *deflate = NULL, const String& extensions = String());
+    ~AsyncWebSocketResponse();
     void _respond(AsyncWebServerRequest *request);
     size_t _ack(AsyncWebServerRequest *request, size_t len, uint32_t time);
     bool _sourceValid() const { return true; }
@@ -0,0 +1,689 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#include "AsyncWebSocketDeflate.h"
+
+#define WS_DEFLATE_HASH_BITS 10
+#define WS_DEFLATE_HASH_SIZE (1 << WS_DEFLATE_HASH_BITS)
+#define WS_DEFLATE_MAX_CHAIN 16
+#define WS_DEFLATE_NICE_MATCH 64
+#define WS_DEFLATE_MIN_MATCH 3
+#define WS_DEFLATE_MAX_MATCH 258
+
+static const uint16_t _lengthBase[29] = { 3,4,5,6,7,8,9,10,11,13,15,17,19,23,27,31,35,43,51,59,67,83,99,115,131,163,195,227,258 };
+static const uint8_t _lengthExtra[29] = { 0,0,0,0,0,0,0,0,1,1,1,1,2,2,2,2,3,3,3,3,4,4,4,4,5,5,5,5,0 };
+static const uint16_t _distBase[30] = { 1,2,3,4,5,7,9,13,17,25,33,49,65,97,129,193,257,385,513,769,1025,1537,2049,3073,4097,6145,8193,12289,16385,24577 };
+static const uint8_t _distExtra[30] = { 0,0,0,0,1,1,2,2,3,3,4,4,5,5,6,6,7,7,8,8,9,9,10,10,11,11,12,12,13,13 };
+static const uint8_t _codeLengthOrder[19] = { 16,17,18,0,8,7,9,6,10,5,11,4,12,3,13,2,14,1,15 };
+
+/*
+ * DEFLATE :: LZ77 over a hash chain, written with the fixed Huffman codes.
+ * The output is never allowed to grow past the input, so the buffer size is known up front
+ * */
+
+typedef struct {
+  uint8_t *buf;
+  size_t size;
+  size_t pos;
+  uint32_t bits;
+  uint8_t count;
+  bool full;
+} DeflateWriter;
+
+static void _putBits(DeflateWriter *w, uint32_t value, uint8_t n){
+  w->bits |= value << w->count;
+  w->count += n;
+  while(w->count >= 8){
+    if(w->pos < w->size)
+      w->buf[w->pos++] = (uint8_t)w->bits;
+    else
+      w->full = true;
+    w->bits >>= 8;
+    w->count -= 8;
+  }
+}
+
+//huffman codes go out most significant bit first
+static void _putCode(DeflateWriter *w, uint16_t code, uint8_t n){
+  uint16_t r = 0;
+  for(uint8_t i = 0; i < n; i++){
+    r = (r << 1) | (code & 1);
+    code >>= 1;
+  }
+  _putBits(w, r, n);
+}
+
+static void _putLiteral(DeflateWriter *w, uint8_t c){
+  if(c < 144)
+    _putCode(w, 0x30 + c, 8);
+  else
+    _putCode(w, 0x190 + (c - 144), 9);
+}
+
+static void _putSymbol(DeflateWriter *w, uint16_t sym){
+  if(sym < 280)
+    _putCode(w, sym - 256, 7);
+  else
+    _putCode(w, 0xC0 + (sym - 280), 8);
+}
+
+static void _putMatch(DeflateWriter *w, uint16_t len, uint16_t dist){
+  uint8_t l = 28;
+  while(_lengthBase[l] > len)
+    l--;
+  _putSymbol(w, 257 + l);
+  if(_lengthExtra[l])
+    _putBits(w, len - _lengthBase[l], _lengthExtra[l]);
+  uint8_t d = 29;
+  while(_distBase[d] > dist)
+    d--;
+  _putCode(w, d, 5);
+  if(_distExtra[d])
+    _putBits(w, dist - _distBase[d], _distExtra[d]);
+}
+
+static inline uint16_t _hash(const uint8_t *p){
+  return (uint16_t)((((uint32_t)p[0] << 16 | (uint32_t)p[1] << 8 | p[2]) * 2654435761u) >> (32 - WS_DEFLATE_HASH_BITS));
+}
+
+uint8_t * AsyncWebSocketDeflate::deflateRaw(const uint8_t *data, size_t len, size_t *outLen, uint8_t windowBits, const uint8_t *history, size_t historyLen){
+  const size_t window = (size_t)1 << windowBits;
+  if(historyLen > window){
+    history += historyLen - window;
+    historyLen = window;
+  }
+  //matches may reach back into the history, so both have to be in one buffer
+  uint8_t *joined = NULL;
+  const uint8_t *buf = data;
+  if(historyLen){
+    joined = (uint8_t*)malloc(historyLen + len);
+    if(joined == NULL)
+      return NULL;
+    memcpy(joined, history, historyLen);
+    memcpy(joined + historyLen, data, len);
+    buf = joined;
+  }
+  const size_t end = historyLen + len;
+  uint16_t *head = (uint16_t*)calloc(WS_DEFLATE_HASH_SIZE + window, sizeof(uint16_t));
+  DeflateWriter w = { (uint8_t*)malloc(len), len, 0, 0, 0, false };
+  if(head == NULL || w.buf == NULL){
+    free(head);
+    free(w.buf);
+    free(joined);
+    return NULL;
+  }
+  uint16_t *prev = head + WS_DEFLATE_HASH_SIZE;
+  const size_t wmask = window - 1;
+
+  //positions are kept modulo 65536, every candidate is checked against the data anyway
+  size_t pos = 0;
+  for(; pos + WS_DEFLATE_MIN_MATCH <= historyLen; pos++){
+    uint16_t h = _hash(buf + pos);
+    prev[pos & wmask] = head[h];
+    head[h] = (uint16_t)pos;
+  }
+  pos = historyLen;
+
+  _putBits(&w, 0x2, 3); //not final, fixed huffman
+  while(pos < end && !w.full){
+    size_t best = 0;
+    size_t bestDist = 0;
+    if(end - pos >= WS_DEFLATE_MIN_MATCH){
+      const size_t maxLen = (end - pos < WS_DEFLATE_MAX_MATCH) ? (end - pos) : WS_DEFLATE_MAX_MATCH;
+      uint16_t h = _hash(buf + pos);
+      uint16_t cand = head[h];
+      size_t lastDist = 0;
+      for(uint8_t chain = 0; chain < WS_DEFLATE_MAX_CHAIN; chain++){
+        size_t dist = (uint16_t)(pos - cand);
+        if(dist <= lastDist || dist > window || dist > pos)
+          break;
+        lastDist = dist;
+        const uint8_t *a = buf + pos;
+        const uint8_t *b = a - dist;
+        if(b[best] == a[best]){
+          size_t l = 0;
+          while(l < maxLen && a[l] == b[l])
+            l++;
+          if(l > best){
+            best = l;
+            bestDist = dist;
+            if(l >= WS_DEFLATE_NICE_MATCH || l == maxLen)
+              break;
+          }
+        }
+        cand = prev[(pos - dist) & wmask];
+      }
+      prev[pos & wmask] = head[h];
+      head[h] = (uint16_t)pos;
+    }
+    if(best >= WS_DEFLATE_MIN_MATCH){
+      _putMatch(&w, best, bestDist);
+      for(size_t i = 1; i < best; i++){
+        size_t p = pos + i;
+        if(p + WS_DEFLATE_MIN_MATCH > end)
+          break;
+        uint16_t h = _hash(buf + p);
+        prev[p & wmask] = head[h];
+        head[h] = (uint16_t)p;
+      }
+      pos += best;
+    } else {
+      _putLiteral(&w, buf[pos]);
+      pos++;
+    }
+  }
+  _putSymbol(&w, 256);
+  //empty stored block of the sync flush, its 00 00 FF FF is left for the receiver to add
+  _putBits(&w, 0, 3);
+  if(w.count)
+    _putBits(&w, 0, 8 - w.count);
+
+  free(head);
+  free(joined);
+  if(w.full){
+    free(w.buf);
+    return NULL;
+  }
+  *outLen = w.pos;
+  return w.buf;
+}
+
+/*
+ * INFLATE :: Stored, fixed and dynamic blocks, canonical Huffman decoding bit by bit
+ * */
+
+typedef struct {
+  uint16_t counts[16];
+  uint16_t symbols[288];
+} InflateTree;
+
+typedef struct {
+  const uint8_t *in;
+  size_t inLen;
+  size_t inPos;
+  uint32_t bits;
+  uint8_t count;
+  uint8_t *out;
+  size_t outLen;
+  size_t outSize;
+  size_t maxLen;
+  AwsInflateResult result;
+  InflateTree lit;
+  InflateTree dist;
+} InflateState;
+
+static int _getBits(InflateState *s, uint8_t n){
+  while(s->count < n){
+    if(s->inPos >= s->inLen){
+      s->result = WS_INFLATE_ERROR;
+      return -1;
+    }
+    s->bits |= (uint32_t)s->in[s->inPos++] << s->count;
+    s->count += 8;
+  }
+  int v = s->bits & ((1UL << n) - 1);
+  s->bits >>= n;
+  s->count -= n;
+  return v;
+}
+
+static bool _buildTree(InflateTree *t, const uint8_t *lengths, uint16_t num){
+  uint16_t offs[16];
+  memset(t->counts, 0, sizeof(t->counts));
+  for(uint16_t i = 0; i < num; i++)
+    t->counts[lengths[i]]++;
+  t->counts[0] = 0;
+  int left = 1;
+  for(uint8_t i = 1; i < 16; i++){
+    left <<= 1;
+    left -= t->counts[i];
+    if(left < 0)
+      return false;
+  }
+  offs[1] = 0;
+  for(uint8_t i = 1; i < 15; i++)
+    offs[i + 1] = offs[i] + t->counts[i];
+  for(uint16_t i = 0; i < num; i++){
+    if(lengths[i])
+      t->symbols[offs[lengths[i]]++] = i;
+  }
+  return true;
+}
+
+static int _decode(InflateState *s, const InflateTree *t){
+  int code = 0, first = 0, index = 0;
+  for(uint8_t len = 1; len < 16; len++){
+    int b = _getBits(s, 1);
+    if(b < 0)
+      return -1;
+    code |= b;
+    int count = t->counts[len];
+    if(code - first < count)
+      return t->symbols[index + code - first];
+    index += count;
+    first += count;
+    first <<= 1;
+    code <<= 1;
+  }
+  s->result = WS_INFLATE_ERROR;
+  return -1;
+}
+
+static bool _reserve(InflateState *s, size_t n){
+  if(s->outLen + n <= s->outSize)
+    return true;
+  if(s->outLen + n > s->maxLen){
+    s->result = WS_INFLATE_TOO_LARGE;
+    return false;
+  }
+  size_t size = s->outSize ? s->outSize : 256;
+  while(size < s->outLen + n)
+    size <<= 1;
+  if(size > s->maxLen)
+    size = s->maxLen;
+  uint8_t *out = (uint8_t*)realloc(s->out, size + 1);
+  if(out == NULL){
+    s->result = WS_INFLATE_TOO_LARGE;
+    return false;
+  }
+  s->out = out;
+  s->outSize = size;
+  return true;
+}
+
+static bool _inflateStored(InflateState *s){
+  s->bits = 0;
+  s->count = 0;
+  if(s->inPos + 4 > s->inLen){
+    s->result = WS_INFLATE_ERROR;
+    return false;
+  }
+  uint16_t len = s->in[s->inPos] | (uint16_t)s->in[s->inPos + 1] << 8;
+  uint16_t nlen = s->in[s->inPos + 2] | (uint16_t)s->in[s->inPos + 3] << 8;
+  s->inPos += 4;
+  if(len != (uint16_t)~nlen || s->inPos + len > s->inLen){
+    s->result = WS_INFLATE_ERROR;
+    return false;
+  }
+  if(!len)
+    return true;
+  if(!_reserve(s, len))
+    return false;
+  memcpy(s->out + s->outLen, s->in + s->inPos, len);
+  s->outLen += len;
+  s->inPos += len;
+  return true;
+}
+
+static bool _inflateCodes(InflateState *s){
+  while(true){
+    int sym = _decode(s, &s->lit);
+    if(sym < 0)
+      return false;
+    if(sym < 256){
+      if(!_reserve(s, 1))
+        return false;
+      s->out[s->outLen++] = (uint8_t)sym;
+    } else if(sym == 256){
+      return true;
+    } else {
+      sym -= 257;
+      if(sym >= 29){
+        s->result = WS_INFLATE_ERROR;
+        return false;
+      }
+      int extra = _getBits(s, _lengthExtra[sym]);
+      if(extra < 0)
+        return false;
+      size_t len = _lengthBase[sym] + extra;
+      int d = _decode(s, &s->dist);
+      if(d < 0)
+        return false;
+      if(d >= 30){
+        s->result = WS_INFLATE_ERROR;
+        return false;
+      }
+      extra = _getBits(s, _distExtra[d]);
+      if(extra < 0)
+        return false;
+      size_t dist = _distBase[d] + extra;
+      if(dist > s->outLen){
+        s->result = WS_INFLATE_ERROR;
+        return false;
+      }
+      if(!_reserve(s, len))
+        return false;
+      uint8_t *o = s->out + s->outLen;
+      for(size_t i = 0; i < len; i++)
+        o[i] = o[i - dist];
+      s->outLen += len;
+    }
+  }
+}
+
+static void _fixedTrees(InflateState *s){
+  uint8_t lengths[288];
+  memset(lengths, 8, 144);
+  memset(lengths + 144, 9, 112);
+  memset(lengths + 256, 7, 24);
+  memset(lengths + 280, 8, 8);
+  _buildTree(&s->lit, lengths, 288);
+  memset(lengths, 5, 30);
+  _buildTree(&s->dist, lengths, 30);
+}
+
+static bool _dynamicTrees(InflateState *s){
+  int hlit = _getBits(s, 5);
+  int hdist = _getBits(s, 5);
+  int hclen = _getBits(s, 4);
+  if(hlit < 0 || hdist < 0 || hclen < 0)
+    return false;
+  hlit += 257;
+  hdist += 1;
+  hclen += 4;
+  if(hlit > 286 || hdist > 30){
+    s->result = WS_INFLATE_ERROR;
+    return false;
+  }
+  uint8_t lengths[286 + 30];
+  memset(lengths, 0, 19);
+  for(int i = 0; i < hclen; i++){
+    int l = _getBits(s, 3);
+    if(l < 0)
+      return false;
+    lengths[_codeLengthOrder[i]] = l;
+  }
+  if(!_buildTree(&s->lit, lengths, 19)){
+    s->result = WS_INFLATE_ERROR;
+    return false;
+  }
+  int n = 0;
+  while(n < hlit + hdist){
+    int sym = _decode(s, &s->lit);
+    if(sym < 0)
+      return false;
+    int repeat = 1;
+    uint8_t value = sym;
+    if(sym == 16){
+      if(n == 0){
+        s->result = WS_INFLATE_ERROR;
+        return false;
+      }
+      value = lengths[n - 1];
+      repeat = _getBits(s, 2) + 3;
+    } else if(sym == 17){
+      value = 0;
+      repeat = _getBits(s, 3) + 3;
+    } else if(sym == 18){
+      value = 0;
+      repeat = _getBits(s, 7) + 11;
+    }
+    if(s->result != WS_INFLATE_OK)
+      return false;
+    if(n + repeat > hlit + hdist){
+      s->result = WS_INFLATE_ERROR;
+      return false;
+    }
+    while(repeat--)
+      lengths[n++] = value;
+  }
+  if(!_buildTree(&s->lit, lengths, hlit) || !_buildTree(&s->dist, lengths + hlit, hdist)){
+    s->result = WS_INFLATE_ERROR;
+    return false;
+  }
+  return true;
+}
+
+AwsInflateResult AsyncWebSocketDeflate::inflateRaw(const uint8_t *in, size_t inLen, uint8_t **out, size_t *outLen, size_t maxLen){
+  static const uint8_t tail[4] = { 0x00, 0x00, 0xFF, 0xFF };
+  *out = NULL;
+  *outLen = 0;
+  //the sender removed the end of the sync flush, put it back
+  uint8_t *buf = (uint8_t*)malloc(inLen + 4);
+  InflateState *s = (InflateState*)malloc(sizeof(InflateState));
+  if(buf == NULL || s == NULL){
+    free(buf);
+    free(s);
+    return WS_INFLATE_TOO_LARGE;
+  }
+  memcpy(buf, in, inLen);
+  memcpy(buf + inLen, tail, 4);
+  memset(s, 0, sizeof(InflateState));
+  s->in = buf;
+  s->inLen = inLen + 4;
+  s->maxLen = maxLen;
+  s->result = WS_INFLATE_OK;
+
+  bool final = false;
+  while(!final && s->result == WS_INFLATE_OK){
+    if(s->inPos >= s->inLen && s->count < 3)
+      break;
+    int header = _getBits(s, 3);
+    if(header < 0)
+      break;
+    final = header & 1;
+    switch(header >> 1){
+      case 0:
+        _inflateStored(s);
+        break;
+      case 1:
+        _fixedTrees(s);
+        _inflateCodes(s);
+        break;
+      case 2:
+        if(_dynamicTrees(s))
+          _inflateCodes(s);
+        break;
+      default:
+        s->result = WS_INFLATE_ERROR;
+        break;
+    }
+  }
+  AwsInflateResult result = s->result;
+  if(result == WS_INFLATE_OK && s->out == NULL){
+    s->out = (uint8_t*)malloc(1);
+    if(s->out == NULL)
+      result = WS_INFLATE_TOO_LARGE;
+  }
+  if(result == WS_INFLATE_OK){
+    s->out[s->outLen] = 0;
+    *out = s->out;
+    *outLen = s->outLen;
+  } else {
+    free(s->out);
+  }
+  free(s);
+  free(buf);
+  return result;
+}
+
+/*
+ * CLIENT STATE
+ * */
+
+AsyncWebSocketDeflate::AsyncWebSocketDeflate(uint8_t windowBits, bool contextTakeover, size_t minSize, size_t maxSize)
+  : _windowBits(windowBits)
+  , _contextTakeover(contextTakeover)
+  , _minSize(minSize ? minSize : 1)
+  , _maxSize(maxSize)
+  , _history(NULL)
+  , _historyLen(0)
+  , _in(NULL)
+  , _inLen(0)
+  , _inSize(0)
+{
+  if(_windowBits < 8)
+    _windowBits = 8;
+  if(_windowBits > 15)
+    _windowBits = 15;
+}
+
+AsyncWebSocketDeflate::~AsyncWebSocketDeflate(){
+  free(_history);
+  free(_in);
+}
+
+uint8_t * AsyncWebSocketDeflate::deflate(const uint8_t *data, size_t len, size_t *outLen){
+  if(len < _minSize)
+    return NULL;
+  uint8_t *out = deflateRaw(data, len, outLen, _windowBits, _history, _historyLen);
+  if(out == NULL || !_contextTakeover)
+    return out;
+  //the client window now ends with this message
+  const size_t window = (size_t)1 << _windowBits;
+  if(_history == NULL){
+    _history = (uint8_t*)malloc(window);
+    if(_history == NULL){
+      //without a window the peer would decode the next message wrongly, send this one plain
+      free(out);
+      _contextTakeover = false;
+      return NULL;
+    }
+  }
+  if(len >= window){
+    memcpy(_history, data + len - window, window);
+    _historyLen = window;
+  } else {
+    size_t keep = _historyLen + len > window ? window - len : _historyLen;
+    memmove(_history, _history + _historyLen - keep, keep);
+    memcpy(_history + keep, data, len);
+    _historyLen = keep + len;
+  }
+  return out;
+}
+
+bool AsyncWebSocketDeflate::append(const uint8_t *data, size_t len){
+  if(_inLen + len > _maxSize)
+    return false;
+  if(_inLen + len > _inSize){
+    size_t size = _inSize ? _inSize : 128;
+    while(size < _inLen + len)
+      size <<= 1;
+    if(size > _maxSize)
+      size = _maxSize;
+    uint8_t *in = (uint8_t*)realloc(_in, size);
+    if(in == NULL)
+      return false;
+    _in = in;
+    _inSize = size;
+  }
+  memcpy(_in + _inLen, data, len);
+  _inLen += len;
+  return true;
+}
+
+AwsInflateResult AsyncWebSocketDeflate::inflate(uint8_t **out, size_t *outLen){
+  AwsInflateResult result;
+  if(_inLen == 0){
+    //an empty message may come without any deflate data
+    *out = (uint8_t*)malloc(1);
+    *outLen = 0;
+    result = (*out == NULL) ? WS_INFLATE_TOO_LARGE : WS_INFLATE_OK;
+    if(*out)
+      (*out)[0] = 0;
+  } else {
+    result = inflateRaw(_in, _inLen, out, outLen, _maxSize);
+  }
+  reset();
+  return result;
+}
+
+void AsyncWebSocketDeflate::reset(){
+  free(_in);
+  _in = NULL;
+  _inLen = 0;
+  _inSize = 0;
+}
+
+/*
+ * NEGOTIATION
+ * */
+
+static String _trimmed(const String &s){
+  String r = s;
+  r.trim();
+  if(r.length() >= 2 && r[0] == '"' && r[r.length() - 1] == '"')
+    r = r.substring(1, r.length() - 1);
+  return r;
+}
+
+bool AsyncWebSocketDeflate::negotiate(const String &offers, uint8_t maxWindowBits, bool contextTakeover, String &response, uint8_t *windowBits, bool *takeover){
+  int start = 0;
+  while(start <= (int)offers.length()){
+    int end = offers.indexOf(',', start);
+    if(end < 0)
+      end = offers.length();
+    String offer = offers.substring(start, end);
+    start = end + 1;
+
+    int p = offer.indexOf(';');
+    if(!_trimmed(p < 0 ? offer : offer.substring(0, p)).equalsIgnoreCase(F("permessage-deflate")))
+      continue;
+    bool valid = true;
+    bool seenServerBits = false, seenClientBits = false, seenServerTakeover = false, seenClientTakeover = false;
+    uint8_t bits = maxWindowBits;
+    bool useTakeover = contextTakeover;
+    while(valid && p >= 0){
+      int next = offer.indexOf(';', p + 1);
+      String param = offer.substring(p + 1, next < 0 ? offer.length() : next);
+      p = next;
+      int eq = param.indexOf('=');
+      String name = _trimmed(eq < 0 ? param : param.substring(0, eq));
+      String value = eq < 0 ? String() : _trimmed(param.substring(eq + 1));
+      if(name.equalsIgnoreCase(F("server_no_context_takeover")) && eq < 0 && !seenServerTakeover){
+        seenServerTakeover = true;
+        useTakeover = false;
+      } else if(name.equalsIgnoreCase(F("client_no_context_takeover")) && eq < 0 && !seenClientTakeover){
+        seenClientTakeover = true;
+      } else if(name.equalsIgnoreCase(F("server_max_window_bits")) && eq >= 0 && !seenServerBits){
+        seenServerBits = true;
+        long v = value.toInt();
+        if(v < 8 || v > 15 || value.length() > 2)
+          valid = false;
+        else if(v < bits)
+          bits = v;
+      } else if(name.equalsIgnoreCase(F("client_max_window_bits")) && !seenClientBits){
+        //we ask for no client context takeover, its window size does not matter
+        seenClientBits = true;
+        if(eq >= 0){
+          long v = value.toInt();
+          if(v < 8 || v > 15 || value.length() > 2)
+            valid = false;
+        }
+      } else {
+        valid = false;
+      }
+    }
+    if(!valid)
+      continue;
+
+    response = F("permessage-deflate; client_no_context_takeover");
+    if(!useTakeover)
+      response += F("; server_no_context_takeover");
+    if(seenServerBits){
+      response += F("; server_max_window_bits=");
+      response += String(bits);
+    }
+    *windowBits = bits;
+    *takeover = useTakeover;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,96 @@
+/*
+  Asynchronous WebServer library for Espressif MCUs
+
+  Copyright (c) 2016 Hristo Gochkov. All rights reserved.
+  This file is part of the esp8266 core for Arduino environment.
+
+  This library is free software; you can redistribute it and/or
+  modify it under the terms of the GNU Lesser General Public
+  License as published by the Free Software Foundation; either
+  version 2.1 of the License, or (at your option) any later version.
+
+  This library is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+  Lesser General Public License for more details.
+
+  You should have received a copy of the GNU Lesser General Public
+  License along with this library; if not, write to the Free Software
+  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+*/
+#ifndef ASYNCWEBSOCKETDEFLATE_H_
+#define ASYNCWEBSOCKETDEFLATE_H_
+
+#include <Arduino.h>
+
+//largest LZ77 window the server compresses with (server_max_window_bits, 8-15)
+#ifndef WS_DEFLATE_WINDOW_BITS
+#ifdef ESP32
+#define WS_DEFLATE_WINDOW_BITS 12
+#else
+#define WS_DEFLATE_WINDOW_BITS 10
+#endif
+#endif
+
+//messages shorter than this are sent uncompressed
+#ifndef WS_DEFLATE_MIN_SIZE
+#define WS_DEFLATE_MIN_SIZE 64
+#endif
+
+//largest incoming message, compressed or inflated. Bigger ones close the connection with 1009
+#ifndef WS_DEFLATE_MAX_MESSAGE_SIZE
+#ifdef ESP32
+#define WS_DEFLATE_MAX_MESSAGE_SIZE 16384
+#else
+#define WS_DEFLATE_MAX_MESSAGE_SIZE 4096
+#endif
+#endif
+
+typedef enum { WS_INFLATE_OK, WS_INFLATE_ERROR, WS_INFLATE_TOO_LARGE } AwsInflateResult;
+
+/*
+ * PERMESSAGE-DEFLATE :: RFC 7692 state of one client.
+ * Outgoing messages use LZ77 with fixed Huffman codes, incoming ones are collected
+ * and inflated whole. client_no_context_takeover is always negotiated, so
+ * incoming messages never refer to earlier ones
+ * */
+
+class AsyncWebSocketDeflate {
+  private:
+    uint8_t _windowBits;
+    bool _contextTakeover;
+    size_t _minSize;
+    size_t _maxSize;
+    uint8_t *_history; //end of the data sent so far, only with server context takeover
+    size_t _historyLen;
+    uint8_t *_in;      //compressed frames of the incoming message
+    size_t _inLen;
+    size_t _inSize;
+
+  public:
+    AsyncWebSocketDeflate(uint8_t windowBits, bool contextTakeover, size_t minSize = WS_DEFLATE_MIN_SIZE, size_t maxSize = WS_DEFLATE_MAX_MESSAGE_SIZE);
+    ~AsyncWebSocketDeflate();
+    AsyncWebSocketDeflate(const AsyncWebSocketDeflate &) = delete;
+    AsyncWebSocketDeflate &operator=(const AsyncWebSocketDeflate &) = delete;
+
+    uint8_t windowBits() const { return _windowBits; }
+    bool contextTakeover() const { return _contextTakeover; }
+    size_t minSize() const { return _minSize; }
+
+    //compresses one whole message. NULL when it is too short or would not get smaller. free() the result
+    uint8_t * deflate(const uint8_t *data, size_t len, size_t *outLen);
+    //collects the payload of an incoming compressed message, false once it is over the limit
+    bool append(const uint8_t *data, size_t len);
+    //inflates the collected message into a malloc()ed buffer with one spare byte
+    AwsInflateResult inflate(uint8_t **out, size_t *outLen);
+    void reset();
+
+    //raw deflate with a sync flush and the trailing 00 00 FF FF removed
+    static uint8_t * deflateRaw(const uint8_t *data, size_t len, size_t *outLen, uint8_t windowBits, const uint8_t *history = NULL, size_t historyLen = 0);
+    //inflates a message that was compressed like above
+    static AwsInflateResult inflateRaw(const uint8_t *in, size_t inLen, uint8_t **out, size_t *outLen, size_t maxLen);
+    //picks the first acceptable offer of a Sec-WebSocket-Extensions header. Fills the response and the agreed parameters
+    static bool negotiate(const String &offers, uint8_t maxWindowBits, bool contextTakeover, String &response, uint8_t *windowBits, bool *takeover);
+};
+
+#endif /* ASYNCWEBSOCKETDEFLATE_H_ */
@@ -3,7 +3,7 @@
 
 // Synchronisation is only available on ESP32, as the ESP8266 isn't using FreeRTOS by default
 
-#include <ESPAsyncWebServer.h>
+#include <Arduino.h>
 
 #ifdef ESP32
 
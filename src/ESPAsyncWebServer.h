@@ -27,6 +27,7 @@
 #include "FS.h"
 
 #include "StringArray.h"
+#include "AsyncWebArena.h"
 
 #ifdef ESP32
 #include <WiFi.h>
@@ -93,7 +94,7 @@ typedef std::function<void(void)> ArDisconnectHandler;
  * PARAMETER :: Chainable object to hold GET/POST and FILE parameters
  * */
 
-class AsyncWebParameter {
+class AsyncWebParameter: public AsyncWebPooled<AsyncWebParameter> {
   private:
     String _name;
     String _value;
@@ -115,7 +116,7 @@ class AsyncWebParameter {
  * HEADER :: Chainable object to hold the headers
  * */
 
-class AsyncWebHeader {
+class AsyncWebHeader: public AsyncWebPooled<AsyncWebHeader> {
   private:
     String _name;
     String _value;
@@ -149,11 +150,14 @@ class AsyncWebServerRequest {
   using FS = fs::FS;
   friend class AsyncWebServer;
   friend class AsyncCallbackWebHandler;
+  friend class AsyncWebSocketClient;
+  friend class AsyncEventSourceClient;
   private:
     AsyncClient* _client;
     AsyncWebServer* _server;
     AsyncWebHandler* _handler;
     AsyncWebServerResponse* _response;
+    AsyncWebArena _arena; //backs headers, params and their list nodes until the request is gone
     StringArray _interestingHeaders;
     ArDisconnectHandler _onDisconnectfn;
 
@@ -173,6 +177,7 @@ class AsyncWebServerRequest {
     bool _isMultipart;
     bool _isPlainPost;
     bool _expectingContinue;
+    bool _discardBody;
     size_t _contentLength;
     size_t _parsedLength;
 
@@ -191,6 +196,16 @@ class AsyncWebServerRequest {
     uint8_t *_itemBuffer;
     size_t _itemBufferIndex;
     bool _itemIsFile;
+    AcDataHandler _handOverData; //new owner of the connection, see _handOver()
+    void *_handOverArg;
+
+    void _bindClient();
+    void _release();
+    void _recycle(AsyncClient* c);
+    //a handler took the connection over (WebSocket upgrade) while _onData runs. When _onData returns
+    //the request is released first, then the bytes after it go to the new owner
+    void _handOver(AcDataHandler handler, void *arg);
+    bool _handedOver(char *rest, size_t len);
 
     void _onPoll();
     void _onAck(size_t len, uint32_t time);
@@ -200,6 +215,7 @@ class AsyncWebServerRequest {
     void _onData(void *buf, size_t len);
 
     void _addParam(AsyncWebParameter*);
+    void _addHeader(const String& name, const String& value);
     void _addPathParam(const char *param);
 
     bool _parseReqHead();
@@ -345,10 +361,14 @@ class AsyncWebHandler {
     ArRequestFilterFunction _filter;
     String _username;
     String _password;
+    size_t _maxContentLength;
   public:
-    AsyncWebHandler():_username(""), _password(""){}
+    AsyncWebHandler():_username(""), _password(""), _maxContentLength(0){}
     AsyncWebHandler& setFilter(ArRequestFilterFunction fn) { _filter = fn; return *this; }
     AsyncWebHandler& setAuthentication(const char *username, const char *password){  _username = String(username);_password = String(password); return *this; };
+    //requests announcing a larger body are answered with 413 (417 if they expect 100-continue) before the body is read. 0 = no limit
+    AsyncWebHandler& setMaxContentLength(size_t maxContentLength){ _maxContentLength = maxContentLength; return *this; }
+    size_t maxContentLength() const { return _maxContentLength; }
     bool filter(AsyncWebServerRequest *request){ return _filter == NULL || _filter(request); }
     virtual ~AsyncWebHandler(){}
     virtual bool canHandle(AsyncWebServerRequest *request __attribute__((unused))){
@@ -409,12 +429,29 @@ typedef std::function<void(AsyncWebServerRequest *request)> ArRequestHandlerFunc
 typedef std::function<void(AsyncWebServerRequest *request, const String& filename, size_t index, uint8_t *data, size_t len, bool final)> ArUploadHandlerFunction;
 typedef std::function<void(AsyncWebServerRequest *request, uint8_t *data, size_t len, size_t index, size_t total)> ArBodyHandlerFunction;
 
+//idle request objects kept for the next connection
+#ifndef ASYNCWEBSERVER_REQUEST_POOL_SIZE
+#ifdef ESP32
+#define ASYNCWEBSERVER_REQUEST_POOL_SIZE 4
+#else
+#define ASYNCWEBSERVER_REQUEST_POOL_SIZE 2
+#endif
+#endif
+
+//connections beyond this many concurrent requests are refused. 0 = no limit
+#ifndef DEFAULT_MAX_REQUESTS
+#define DEFAULT_MAX_REQUESTS 0
+#endif
+
 class AsyncWebServer {
   protected:
     AsyncServer _server;
     LinkedList<AsyncWebRewrite*> _rewrites;
     LinkedList<AsyncWebHandler*> _handlers;
     AsyncCallbackWebHandler* _catchAllHandler;
+    LinkedList<AsyncWebServerRequest*> _requestPool;
+    size_t _maxRequests;
+    size_t _activeRequests;
 
   public:
     AsyncWebServer(uint16_t port);
@@ -448,6 +485,12 @@ class AsyncWebServer {
 
     void reset(); //remove all writers and handlers, with onNotFound/onFileUpload/onRequestBody
 
+    void setMaxRequests(size_t maxRequests){ _maxRequests = maxRequests; } //0 = no limit
+    size_t maxRequests() const { return _maxRequests; }
+    size_t activeRequests() const { return _activeRequests; }
+
+    AsyncWebServerRequest *_newRequest(AsyncClient *client);
+    void _releaseRequest(AsyncWebServerRequest *request);
     void _handleDisconnect(AsyncWebServerRequest *request);
     void _attachHandler(AsyncWebServerRequest *request);
     void _rewriteRequest(AsyncWebServerRequest *request);
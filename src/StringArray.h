@@ -22,10 +22,23 @@
 #define STRINGARRAY_H_
 
 #include "stddef.h"
+#include <new>
 #include "WString.h"
+#include "AsyncWebSlab.h"
+
+/*
+ * Source of memory for list nodes. Lists without one use new/delete.
+ * */
+
+class LinkedListAllocator {
+  public:
+    virtual ~LinkedListAllocator(){}
+    virtual void* allocate(size_t size) = 0;
+    virtual void deallocate(void* ptr, size_t size) = 0;
+};
 
 template <typename T>
-class LinkedListNode {
+class LinkedListNode : public AsyncWebPooled<LinkedListNode<T>> {
     T _value;
   public:
     LinkedListNode<T>* next;
@@ -43,7 +56,25 @@ class LinkedList {
     typedef std::function<bool(const T&)> Predicate;
   private:
     ItemType* _root;
+    ItemType* _last; //tail, so add() does not walk the list
+    size_t _count;
     OnRemove _onRemove;
+    LinkedListAllocator* _allocator;
+
+    ItemType* _newNode(const T& t){
+      if(!_allocator)
+        return new ItemType(t);
+      void* mem = _allocator->allocate(sizeof(ItemType));
+      return mem ? new(mem) ItemType(t) : nullptr;
+    }
+    void _deleteNode(ItemType* it){
+      if(!_allocator){
+        delete it;
+        return;
+      }
+      it->~ItemType();
+      _allocator->deallocate(it, sizeof(ItemType));
+    }
 
     class Iterator {
       ItemType* _node;
@@ -61,17 +92,41 @@ class LinkedList {
     ConstIterator begin() const { return ConstIterator(_root); }
     ConstIterator end() const { return ConstIterator(nullptr); }
 
-    LinkedList(OnRemove onRemove) : _root(nullptr), _onRemove(onRemove) {}
+    LinkedList(OnRemove onRemove, LinkedListAllocator* allocator = nullptr) : _root(nullptr), _last(nullptr), _count(0), _onRemove(onRemove), _allocator(allocator) {}
     ~LinkedList(){}
     void add(const T& t){
-      auto it = new ItemType(t);
+      auto it = _newNode(t);
+      if(!it)
+        return;
       if(!_root){
         _root = it;
       } else {
-        auto i = _root;
-        while(i->next) i = i->next;
-        i->next = it;
+        _last->next = it;
       }
+      _last = it;
+      _count++;
+    }
+    //in front of the first item the predicate is true for, at the end if there is none
+    void insert(const T& t, Predicate before){
+      auto pit = (ItemType*)nullptr;
+      auto it = _root;
+      while(it && !before(it->value())){
+        pit = it;
+        it = it->next;
+      }
+      if(!it){
+        add(t);
+        return;
+      }
+      auto node = _newNode(t);
+      if(!node)
+        return;
+      node->next = it;
+      if(pit)
+        pit->next = node;
+      else
+        _root = node;
+      _count++;
     }
     T& front() const {
       return _root->value();
@@ -81,13 +136,7 @@ class LinkedList {
       return _root == nullptr;
     }
     size_t length() const {
-      size_t i = 0;
-      auto it = _root;
-      while(it){
-        i++;
-        it = it->next;
-      }
-      return i;
+      return _count;
     }
     size_t count_if(Predicate predicate) const {
       size_t i = 0;
@@ -123,12 +172,16 @@ class LinkedList {
           } else {
             pit->next = it->next;
           }
+          if(it == _last){
+            _last = (it == pit) ? nullptr : pit;
+          }
+          _count--;
           
           if (_onRemove) {
             _onRemove(it->value());
           }
           
-          delete it;
+          _deleteNode(it);
           return true;
         }
         pit = it;
@@ -146,10 +199,14 @@ class LinkedList {
           } else {
             pit->next = it->next;
           }
+          if(it == _last){
+            _last = (it == pit) ? nullptr : pit;
+          }
+          _count--;
           if (_onRemove) {
             _onRemove(it->value());
           }
-          delete it;
+          _deleteNode(it);
           return true;
         }
         pit = it;
@@ -162,12 +219,14 @@ class LinkedList {
       while(_root != nullptr){
         auto it = _root;
         _root = _root->next;
+        if(_root == nullptr)
+          _last = nullptr;
+        _count--;
         if (_onRemove) {
           _onRemove(it->value());
         }
-        delete it;
+        _deleteNode(it);
       }
-      _root = nullptr;
     }
 };
 
@@ -175,7 +234,7 @@ class LinkedList {
 class StringArray : public LinkedList<String> {
 public:
   
-  StringArray() : LinkedList(nullptr) {}
+  StringArray(LinkedListAllocator* allocator = nullptr) : LinkedList(nullptr, allocator) {}
   
   bool containsIgnoreCase(const String& str){
     for (const auto& s : *this) {
@@ -35,6 +35,8 @@ AsyncWebServerRequest::AsyncWebServerRequest(AsyncWebServer* s, AsyncClient* c)
   , _server(s)
   , _handler(NULL)
   , _response(NULL)
+  , _arena()
+  , _interestingHeaders(_arena.listAllocator())
   , _temp()
   , _parseState(0)
   , _version(0)
@@ -49,11 +51,12 @@ AsyncWebServerRequest::AsyncWebServerRequest(AsyncWebServer* s, AsyncClient* c)
   , _isMultipart(false)
   , _isPlainPost(false)
   , _expectingContinue(false)
+  , _discardBody(false)
   , _contentLength(0)
   , _parsedLength(0)
-  , _headers(LinkedList<AsyncWebHeader *>([](AsyncWebHeader *h){ delete h; }))
-  , _params(LinkedList<AsyncWebParameter *>([](AsyncWebParameter *p){ delete p; }))
-  , _pathParams(LinkedList<String *>([](String *p){ delete p; }))
+  , _headers(LinkedList<AsyncWebHeader *>([this](AsyncWebHeader *h){ _arena.destroy(h); }, _arena.listAllocator()))
+  , _params(LinkedList<AsyncWebParameter *>([this](AsyncWebParameter *p){ _arena.destroy(p); }, _arena.listAllocator()))
+  , _pathParams(LinkedList<String *>([this](String *p){ _arena.destroy(p); }, _arena.listAllocator()))
   , _multiParseState(0)
   , _boundaryPosition(0)
   , _itemStartIndex(0)
@@ -65,8 +68,19 @@ AsyncWebServerRequest::AsyncWebServerRequest(AsyncWebServer* s, AsyncClient* c)
   , _itemBuffer(0)
   , _itemBufferIndex(0)
   , _itemIsFile(false)
+  , _handOverData(nullptr)
+  , _handOverArg(NULL)
   , _tempObject(NULL)
 {
+  _bindClient();
+}
+
+AsyncWebServerRequest::~AsyncWebServerRequest(){
+  _release();
+}
+
+void AsyncWebServerRequest::_bindClient(){
+  AsyncClient* c = _client;
   c->onError([](void *r, AsyncClient* c, int8_t error){ (void)c; AsyncWebServerRequest *req = (AsyncWebServerRequest*)r; req->_onError(error); }, this);
   c->onAck([](void *r, AsyncClient* c, size_t len, uint32_t time){ (void)c; AsyncWebServerRequest *req = (AsyncWebServerRequest*)r; req->_onAck(len, time); }, this);
   c->onDisconnect([](void *r, AsyncClient* c){ AsyncWebServerRequest *req = (AsyncWebServerRequest*)r; req->_onDisconnect(); delete c; }, this);
@@ -75,7 +89,8 @@ AsyncWebServerRequest::AsyncWebServerRequest(AsyncWebServer* s, AsyncClient* c)
   c->onPoll([](void *r, AsyncClient* c){ (void)c; AsyncWebServerRequest *req = ( AsyncWebServerRequest*)r; req->_onPoll(); }, this);
 }
 
-AsyncWebServerRequest::~AsyncWebServerRequest(){
+//frees everything the request owns. The object itself stays usable for _recycle()
+void AsyncWebServerRequest::_release(){
   _headers.free();
 
   _params.free();
@@ -85,20 +100,82 @@ AsyncWebServerRequest::~AsyncWebServerRequest(){
 
   if(_response != NULL){
     delete _response;
+    _response = NULL;
   }
 
   if(_tempObject != NULL){
     free(_tempObject);
+    _tempObject = NULL;
   }
 
   if(_tempFile){
     _tempFile.close();
   }
-  
+  _tempFile = File();
+
   if(_itemBuffer){
     free(_itemBuffer);
+    _itemBuffer = NULL;
   }
-  
+
+  _arena.reset();
+}
+
+//puts a pooled request back to the state the constructor leaves it in
+void AsyncWebServerRequest::_recycle(AsyncClient* c){
+  _release();
+  _client = c;
+  _handler = NULL;
+  _onDisconnectfn = nullptr;
+  _temp = String();
+  _parseState = 0;
+  _version = 0;
+  _method = HTTP_ANY;
+  _url = String();
+  _host = String();
+  _contentType = String();
+  _boundary = String();
+  _authorization = String();
+  _reqconntype = RCT_HTTP;
+  _isDigest = false;
+  _isMultipart = false;
+  _isPlainPost = false;
+  _expectingContinue = false;
+  _discardBody = false;
+  _contentLength = 0;
+  _parsedLength = 0;
+  _multiParseState = 0;
+  _boundaryPosition = 0;
+  _itemStartIndex = 0;
+  _itemSize = 0;
+  _itemName = String();
+  _itemFilename = String();
+  _itemType = String();
+  _itemValue = String();
+  _itemBufferIndex = 0;
+  _itemIsFile = false;
+  _handOverData = nullptr;
+  _handOverArg = NULL;
+  _bindClient();
+}
+
+void AsyncWebServerRequest::_handOver(AcDataHandler handler, void *arg){
+  _handOverData = handler;
+  _handOverArg = arg;
+}
+
+//releases the request, then passes what is left of the segment to the new owner, which may close the
+//connection. The request is back in the pool before that, so nothing may touch it afterwards
+bool AsyncWebServerRequest::_handedOver(char *rest, size_t len){
+  if(!_handOverData)
+    return false;
+  AcDataHandler handler = _handOverData;
+  void *arg = _handOverArg;
+  AsyncClient *client = _client;
+  _server->_releaseRequest(this);
+  if(len)
+    handler(arg, client, rest, len);
+  return true;
 }
 
 void AsyncWebServerRequest::_onData(void *buf, size_t len){
@@ -124,13 +201,31 @@ void AsyncWebServerRequest::_onData(void *buf, size_t len){
       _temp.concat(str);
       _temp.trim();
       _parseLine();
-      if (++i < len) {
+      ++i;
+      if(_handedOver(str + i, len - i))
+        return;
+      if (i < len) {
         // Still have more buffer to process
         buf = str+i;
         len-= i;
         continue;
       }
     }
+  } else if(_parseState == PARSE_REQ_BODY && _discardBody){
+    //a refused body is read and dropped so that closing does not reset the connection under the 413
+    size_t left = _contentLength - _parsedLength;
+    _parsedLength += (len < left) ? len : left;
+    if(_parsedLength == _contentLength){
+      _parseState = PARSE_REQ_END;
+      _discardBody = false;
+      if(_response != NULL && _response->_finished()){
+        AsyncWebServerResponse* r = _response;
+        _response = NULL;
+        delete r;
+
+        _client->close();
+      }
+    }
   } else if(_parseState == PARSE_REQ_BODY){
     // A handler should be already attached at this point in _parseLine function.
     // If handler does nothing (_onRequest is NULL), we don't need to really parse the body.
@@ -175,6 +270,8 @@ void AsyncWebServerRequest::_onData(void *buf, size_t len){
       //check if authenticated before calling handleRequest and request auth instead
       if(_handler) _handler->handleRequest(this);
       else send(501);
+      if(_handedOver(NULL, 0))
+        return;
     }
   }
   break;
@@ -195,7 +292,7 @@ void AsyncWebServerRequest::_onPoll(){
   if(_response != NULL && _client != NULL && _client->canSend()){
     if(!_response->_finished()){
       _response->_ack(this, 0, 0);
-    } else {
+    } else if(!_discardBody){
       AsyncWebServerResponse* r = _response;
       _response = NULL;
       delete r;
@@ -210,7 +307,7 @@ void AsyncWebServerRequest::_onAck(size_t len, uint32_t time){
   if(_response != NULL){
     if(!_response->_finished()){
       _response->_ack(this, len, time);
-    } else if(_response->_finished()){
+    } else if(_response->_finished() && !_discardBody){
       AsyncWebServerResponse* r = _response;
       _response = NULL;
       delete r;
@@ -243,11 +340,20 @@ void AsyncWebServerRequest::_onDisconnect(){
 }
 
 void AsyncWebServerRequest::_addParam(AsyncWebParameter *p){
-  _params.add(p);
+  if(p != NULL)
+    _params.add(p);
 }
 
 void AsyncWebServerRequest::_addPathParam(const char *p){
-  _pathParams.add(new String(p));
+  String *param = _arena.make<String>(p);
+  if(param != NULL)
+    _pathParams.add(param);
+}
+
+void AsyncWebServerRequest::_addHeader(const String& name, const String& value){
+  AsyncWebHeader *header = _arena.make<AsyncWebHeader>(name, value);
+  if(header != NULL)
+    _headers.add(header);
 }
 
 void AsyncWebServerRequest::_addGetParams(const String& params){
@@ -259,7 +365,7 @@ void AsyncWebServerRequest::_addGetParams(const String& params){
     if (equal < 0 || equal > end) equal = end;
     String name = params.substring(start, equal);
     String value = equal + 1 < end ? params.substring(equal + 1, end) : String();
-    _addParam(new AsyncWebParameter(urlDecode(name), urlDecode(value)));
+    _addParam(_arena.make<AsyncWebParameter>(urlDecode(name), urlDecode(value)));
     start = end + 1;
   }
 }
@@ -361,7 +467,7 @@ bool AsyncWebServerRequest::_parseReqHeader(){
         }
       }
     }
-    _headers.add(new AsyncWebHeader(name, value));
+    _addHeader(name, value);
   }
   _temp = String();
   return true;
@@ -377,7 +483,7 @@ void AsyncWebServerRequest::_parsePlainPostChar(uint8_t data){
       name = _temp.substring(0, _temp.indexOf('='));
       value = _temp.substring(_temp.indexOf('=') + 1);
     }
-    _addParam(new AsyncWebParameter(urlDecode(name), urlDecode(value), true));
+    _addParam(_arena.make<AsyncWebParameter>(urlDecode(name), urlDecode(value), true));
     _temp = String();
   }
 }
@@ -524,13 +630,13 @@ void AsyncWebServerRequest::_parseMultipartPostByte(uint8_t data, bool last){
     } else if(_boundaryPosition == _boundary.length() - 1){
       _multiParseState = DASH3_OR_RETURN2;
       if(!_itemIsFile){
-        _addParam(new AsyncWebParameter(_itemName, _itemValue, true));
+        _addParam(_arena.make<AsyncWebParameter>(_itemName, _itemValue, true));
       } else {
         if(_itemSize){
           //check if authenticated before calling the upload
           if(_handler) _handler->handleUpload(this, _itemFilename, _itemSize - _itemBufferIndex, _itemBuffer, _itemBufferIndex, true);
           _itemBufferIndex = 0;
-          _addParam(new AsyncWebParameter(_itemName, _itemFilename, true, true, _itemSize));
+          _addParam(_arena.make<AsyncWebParameter>(_itemName, _itemFilename, true, true, _itemSize));
         }
         free(_itemBuffer);
         _itemBuffer = NULL;
@@ -585,6 +691,19 @@ void AsyncWebServerRequest::_parseLine(){
       _server->_rewriteRequest(this);
       _server->_attachHandler(this);
       _removeNotInterestingHeaders();
+      if(_contentLength && _handler && _handler->maxContentLength() && _contentLength > _handler->maxContentLength()){
+        //refuse the body before the client spends time sending it. Without 100-continue it is on its way
+        //already, so it is drained before the connection is closed
+        if(_expectingContinue){
+          _parseState = PARSE_REQ_END;
+          send(417);
+        } else {
+          _parseState = PARSE_REQ_BODY;
+          _discardBody = true;
+          send(413);
+        }
+        return;
+      }
       if(_expectingContinue){
         String response = F("HTTP/1.1 100 Continue\r\n\r\n");
         _client->write(response.c_str(), response.length());
@@ -39,6 +39,9 @@ AsyncWebServer::AsyncWebServer(uint16_t port)
   : _server(port)
   , _rewrites(LinkedList<AsyncWebRewrite*>([](AsyncWebRewrite* r){ delete r; }))
   , _handlers(LinkedList<AsyncWebHandler*>([](AsyncWebHandler* h){ delete h; }))
+  , _requestPool(LinkedList<AsyncWebServerRequest*>(nullptr))
+  , _maxRequests(DEFAULT_MAX_REQUESTS)
+  , _activeRequests(0)
 {
   _catchAllHandler = new AsyncCallbackWebHandler();
   if(_catchAllHandler == NULL)
@@ -47,7 +50,7 @@ AsyncWebServer::AsyncWebServer(uint16_t port)
     if(c == NULL)
       return;
     c->setRxTimeout(3);
-    AsyncWebServerRequest *r = new AsyncWebServerRequest((AsyncWebServer*)s, c);
+    AsyncWebServerRequest *r = ((AsyncWebServer*)s)->_newRequest(c);
     if(r == NULL){
       c->close(true);
       c->free();
@@ -59,6 +62,9 @@ AsyncWebServer::AsyncWebServer(uint16_t port)
 AsyncWebServer::~AsyncWebServer(){
   reset();
   end();
+  for(const auto& r: _requestPool)
+    delete r;
+  _requestPool.free();
   if(_catchAllHandler) delete _catchAllHandler;
 }
 
@@ -103,8 +109,39 @@ void AsyncWebServer::beginSecure(const char *cert, const char *key, const char *
 }
 #endif
 
+AsyncWebServerRequest *AsyncWebServer::_newRequest(AsyncClient *client){
+  if(_maxRequests && _activeRequests >= _maxRequests)
+    return NULL;
+  AsyncWebServerRequest *request;
+  if(!_requestPool.isEmpty()){
+    request = _requestPool.front();
+    _requestPool.remove_first([](AsyncWebServerRequest *r){ (void)r; return true; });
+    request->_recycle(client);
+  } else {
+    request = new AsyncWebServerRequest(this, client);
+    if(request == NULL)
+      return NULL;
+  }
+  _activeRequests++;
+  return request;
+}
+
+void AsyncWebServer::_releaseRequest(AsyncWebServerRequest *request){
+  if(_activeRequests)
+    _activeRequests--;
+  size_t poolSize = ASYNCWEBSERVER_REQUEST_POOL_SIZE;
+  if(_maxRequests && _maxRequests < poolSize)
+    poolSize = _maxRequests;
+  if(_requestPool.length() < poolSize){
+    request->_release();
+    _requestPool.add(request);
+  } else {
+    delete request;
+  }
+}
+
 void AsyncWebServer::_handleDisconnect(AsyncWebServerRequest *request){
-  delete request;
+  _releaseRequest(request);
 }
 
 void AsyncWebServer::_rewriteRequest(AsyncWebServerRequest *request){